@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * command_fifo.cpp - read newline separated commands from the control FIFO.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <system_error>
+
+#include "core/logging.hpp"
+
+#include "command_fifo.hpp"
+
+CommandFifo::CommandFifo(std::string const &path, CommandCallback callback) : path_(path), callback_(callback)
+{
+	// NOTE: Opening read/write means there is always a writer, so we neither block here
+	// waiting for the web interface nor see POLLHUP every time it closes its end.
+	fd_ = open(path_.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), path_);
+
+	stop_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd_ < 0)
+	{
+		int err = errno;
+		close(fd_);
+		throw std::system_error(err, std::generic_category(), "eventfd");
+	}
+
+	poll_thread_ = std::thread(&CommandFifo::pollThread, this);
+}
+
+CommandFifo::~CommandFifo()
+{
+	uint64_t value = 1;
+	if (write(stop_fd_, &value, sizeof(value)) < 0)
+		LOG_ERROR("Failed to stop command FIFO thread");
+	poll_thread_.join();
+
+	close(stop_fd_);
+	close(fd_);
+}
+
+void CommandFifo::pollThread()
+{
+	pollfd fds[2] = { { fd_, POLLIN, 0 }, { stop_fd_, POLLIN, 0 } };
+	char buffer[256];
+
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("Polling " << path_ << " failed: " << errno);
+			return;
+		}
+
+		if (fds[1].revents & POLLIN)
+			return;
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		ssize_t bytes_read;
+		while ((bytes_read = read(fd_, buffer, sizeof(buffer))) > 0)
+			buffer_.append(buffer, bytes_read);
+
+		dispatchLines();
+	}
+}
+
+void CommandFifo::dispatchLines()
+{
+	size_t start = 0, end;
+	while ((end = buffer_.find('\n', start)) != std::string::npos)
+	{
+		std::string command = buffer_.substr(start, end - start);
+		start = end + 1;
+
+		// Tolerate CRLF line endings.
+		if (!command.empty() && command.back() == '\r')
+			command.pop_back();
+		if (!command.empty())
+			callback_(command);
+	}
+	buffer_.erase(0, start);
+}
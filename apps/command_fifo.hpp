@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * command_fifo.hpp - read newline separated commands from the control FIFO.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+
+// Watches the control FIFO in its own thread and hands every complete command
+// line, in order, to the callback as soon as it arrives.
+class CommandFifo
+{
+public:
+	typedef std::function<void(std::string const &)> CommandCallback;
+
+	CommandFifo(std::string const &path, CommandCallback callback);
+	~CommandFifo();
+
+private:
+	void pollThread();
+	// Split off and deliver every complete line in buffer_.
+	void dispatchLines();
+
+	std::string path_;
+	CommandCallback callback_;
+	int fd_;
+	int stop_fd_;
+	// Bytes received after the last newline, kept until the rest of the command arrives.
+	std::string buffer_;
+	std::thread poll_thread_;
+};
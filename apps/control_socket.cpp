@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * control_socket.cpp - take batches of commands over a Unix socket, and acknowledge them.
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <system_error>
+
+#include "core/logging.hpp"
+
+#include "control_socket.hpp"
+
+// The epoll data for the listening socket and the stop eventfd, client numbers start above.
+static constexpr uint64_t LISTEN = 0;
+static constexpr uint64_t STOP = ~0ull;
+
+// Batch ids are the client number and how many batches it has sent.
+static uint64_t batch_id(uint64_t client, uint32_t batch)
+{
+	return client << 32 | batch;
+}
+
+ControlSocket::ControlSocket(std::string const &path, BatchCallback callback) : path_(path), callback_(callback)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("control socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), "socket");
+
+	unlink(path.c_str());
+	// Same as the FIFO, which the web interface creates world writable.
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path.c_str(), 0666) < 0 ||
+		listen(listen_fd_, 8) < 0)
+	{
+		int err = errno;
+		close(listen_fd_);
+		throw std::system_error(err, std::generic_category(), path);
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	stop_fd_ = eventfd(0, EFD_CLOEXEC);
+	epoll_event listen_event = {};
+	listen_event.events = EPOLLIN;
+	listen_event.data.u64 = LISTEN;
+	epoll_event stop_event = {};
+	stop_event.events = EPOLLIN;
+	stop_event.data.u64 = STOP;
+	if (epoll_fd_ < 0 || stop_fd_ < 0 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &listen_event) < 0 ||
+		epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &stop_event) < 0)
+	{
+		int err = errno;
+		close(listen_fd_);
+		if (epoll_fd_ >= 0)
+			close(epoll_fd_);
+		if (stop_fd_ >= 0)
+			close(stop_fd_);
+		throw std::system_error(err, std::generic_category(), "epoll");
+	}
+
+	thread_ = std::thread(&ControlSocket::epollThread, this);
+}
+
+ControlSocket::~ControlSocket()
+{
+	uint64_t value = 1;
+	if (write(stop_fd_, &value, sizeof(value)) < 0)
+		LOG_ERROR("Failed to stop control socket thread");
+	thread_.join();
+
+	for (auto const &[client, fd] : clients_)
+		close(fd);
+	close(stop_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+void ControlSocket::Reply(uint64_t id, std::string const &reply)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = clients_.find(id >> 32);
+	if (it == clients_.end())
+		return;
+	// Never wait on a client that isn't reading its replies.
+	if (send(it->second, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		LOG(1, "Failed to reply to control socket client " << it->first << ": " << strerror(errno));
+}
+
+void ControlSocket::epollThread()
+{
+	epoll_event events[16];
+	while (true)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("Waiting on control socket failed: " << strerror(errno));
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			uint64_t source = events[i].data.u64;
+			if (source == STOP)
+				return;
+			else if (source == LISTEN)
+				accept();
+			else if (events[i].events & EPOLLIN)
+				receive(source);
+			else
+				disconnect(source);
+		}
+	}
+}
+
+void ControlSocket::accept()
+{
+	int fd;
+	while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		uint64_t client = next_client_++;
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.u64 = client;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			LOG_ERROR("Failed to watch control socket client: " << strerror(errno));
+			close(fd);
+			continue;
+		}
+		clients_[client] = fd;
+		batches_[client] = 0;
+		LOG(2, "Control socket client " << client << " connected");
+	}
+}
+
+void ControlSocket::receive(uint64_t client)
+{
+	int fd;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = clients_.find(client);
+		if (it == clients_.end())
+			return;
+		fd = it->second;
+	}
+
+	char buffer[MAX_PACKET];
+	ssize_t size;
+	while ((size = recv(fd, buffer, sizeof(buffer), MSG_TRUNC)) > 0)
+	{
+		uint64_t id = batch_id(client, ++batches_[client]);
+		if (size > (ssize_t)sizeof(buffer))
+		{
+			Reply(id, "ERR batch longer than " + std::to_string(MAX_PACKET) + " bytes\n");
+			continue;
+		}
+
+		std::vector<std::string> commands;
+		size_t start = 0;
+		std::string batch(buffer, size);
+		while (start < batch.size())
+		{
+			size_t end = batch.find('\n', start);
+			if (end == std::string::npos)
+				end = batch.size();
+			std::string command = batch.substr(start, end - start);
+			start = end + 1;
+			// Tolerate CRLF line endings.
+			if (!command.empty() && command.back() == '\r')
+				command.pop_back();
+			if (!command.empty())
+				commands.push_back(command);
+		}
+		if (commands.empty())
+			Reply(id, "ERR empty batch\n");
+		else
+			callback_(id, std::move(commands));
+	}
+
+	// A zero length read is the client hanging up.
+	if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		disconnect(client);
+}
+
+void ControlSocket::disconnect(uint64_t client)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = clients_.find(client);
+	if (it == clients_.end())
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second, nullptr);
+	close(it->second);
+	clients_.erase(it);
+	batches_.erase(client);
+	LOG(2, "Control socket client " << client << " disconnected");
+}
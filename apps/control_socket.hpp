@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * control_socket.hpp - take batches of commands over a Unix socket, and acknowledge them.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A SOCK_SEQPACKET socket alongside the control FIFO. Each packet a client sends is a batch of
+// newline separated commands, handed to the callback with an id. Once they have been handled,
+// Reply() sends that client one packet back. Any number of clients can be connected, all
+// served from one epoll thread.
+class ControlSocket
+{
+public:
+	static constexpr size_t MAX_PACKET = 4096;
+
+	typedef std::function<void(uint64_t id, std::vector<std::string> commands)> BatchCallback;
+
+	// Replaces anything already at the path.
+	ControlSocket(std::string const &path, BatchCallback callback);
+	~ControlSocket();
+
+	// Answer the batch. Quietly does nothing if the client has gone.
+	void Reply(uint64_t id, std::string const &reply);
+
+private:
+	void epollThread();
+	void accept();
+	void receive(uint64_t client);
+	void disconnect(uint64_t client);
+
+	std::string path_;
+	BatchCallback callback_;
+	int listen_fd_;
+	int epoll_fd_;
+	int stop_fd_;
+	std::mutex mutex_;
+	// Numbered rather than going by fd, which could be reused while a reply is pending.
+	std::map<uint64_t, int> clients_;
+	uint64_t next_client_ = 1;
+	std::map<uint64_t, uint32_t> batches_; // per client
+	std::thread thread_;
+};
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_pacer.cpp - pick frames to keep by sensor timestamp.
+ */
+
+#include <algorithm>
+
+#include "frame_pacer.hpp"
+
+void FramePacer::SetInterval(std::chrono::nanoseconds interval)
+{
+	interval_ns_ = std::max<int64_t>(interval.count(), 0);
+}
+
+void FramePacer::SetDivider(unsigned int divider)
+{
+	divider_ = std::max(divider, 1u);
+}
+
+void FramePacer::Reset()
+{
+	last_timestamp_ = 0;
+	frame_period_ = 0;
+	off_count_ = 0;
+	off_total_ = 0;
+	next_due_ = 0;
+	last_accepted_ = 0;
+}
+
+bool FramePacer::Accept(uint64_t timestamp_ns)
+{
+	// Timestamps going backwards means the camera restarted.
+	if (timestamp_ns < last_timestamp_)
+		Reset();
+
+	// Track the frame period. A lone long gap is a frame the camera dropped and is ignored, but
+	// a run of deltas well away from the period (AE slowing the sensor down, or letting it speed
+	// up again) starts it again from them.
+	if (last_timestamp_)
+	{
+		uint64_t delta = timestamp_ns - last_timestamp_;
+		if (!frame_period_)
+			frame_period_ = delta;
+		else if (delta < frame_period_ * 3 / 2 && delta > frame_period_ * 2 / 3)
+		{
+			frame_period_ = (frame_period_ * 7 + delta) / 8;
+			off_count_ = 0;
+			off_total_ = 0;
+		}
+		else
+		{
+			off_total_ += delta;
+			if (++off_count_ == RESEED_AFTER)
+			{
+				frame_period_ = off_total_ / off_count_;
+				off_count_ = 0;
+				off_total_ = 0;
+			}
+		}
+	}
+	last_timestamp_ = timestamp_ns;
+
+	uint64_t interval = std::max<uint64_t>(interval_ns_, divider_ > 1 ? divider_ * frame_period_ : 0);
+	if (interval == 0)
+	{
+		// No limit, or we don't know the frame period yet.
+		next_due_ = 0;
+		last_accepted_ = timestamp_ns;
+		accepted_++;
+		return true;
+	}
+
+	if (!next_due_ && last_accepted_)
+		next_due_ = last_accepted_ + interval;
+
+	if (next_due_ && timestamp_ns + frame_period_ / 2 < next_due_)
+	{
+		skipped_++;
+		return false;
+	}
+
+	// Stay in step with the schedule while frames arrive on time. A late frame (one was
+	// dropped, or the interval changed) starts a new schedule from itself.
+	if (next_due_ && timestamp_ns <= next_due_ + frame_period_ / 2)
+		next_due_ += interval;
+	else
+		next_due_ = timestamp_ns + interval;
+
+	last_accepted_ = timestamp_ns;
+	accepted_++;
+	return true;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_pacer.hpp - pick frames to keep by sensor timestamp.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Decimates a stream of frames by their sensor timestamps, so the output rate is right
+// whatever the camera frame rate is (and if it changes), and frames dropped by the camera are
+// not counted.
+// Frames are accepted no closer together than the larger of the interval and "divider"
+// frame periods, with half a frame period of slack for timestamp jitter.
+class FramePacer
+{
+public:
+	// Zero means no limit.
+	void SetInterval(std::chrono::nanoseconds interval);
+	// Keep one in every divider frames, 0 or 1 means every frame.
+	void SetDivider(unsigned int divider);
+	// Start again from the next frame (e.g. after the camera restarts).
+	void Reset();
+
+	// Returns true if the frame with this sensor timestamp (in ns) should be used.
+	bool Accept(uint64_t timestamp_ns);
+
+	uint64_t Accepted() const { return accepted_; }
+	uint64_t Skipped() const { return skipped_; }
+
+private:
+	// Deltas in a row this far from the frame period mean the frame rate has changed, rather
+	// than that the camera dropped a frame.
+	static constexpr unsigned int RESEED_AFTER = 3;
+
+	uint64_t interval_ns_ = 0;
+	unsigned int divider_ = 1;
+	uint64_t last_timestamp_ = 0;
+	uint64_t frame_period_ = 0;
+	unsigned int off_count_ = 0;
+	uint64_t off_total_ = 0;
+	uint64_t next_due_ = 0;
+	uint64_t last_accepted_ = 0;
+	uint64_t accepted_ = 0;
+	uint64_t skipped_ = 0;
+};
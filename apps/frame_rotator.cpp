@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_rotator.cpp - rotate YUV420 frames by 90 or 270 degrees.
+ */
+
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <libcamera/base/unique_fd.h>
+#include <libcamera/formats.h>
+
+#include "core/dma_heaps.hpp"
+#include "core/logging.hpp"
+
+#include "frame_rotator.hpp"
+
+// Only buffers of the current frame size are kept.
+struct FrameRotator::Pool
+{
+	struct Buffer
+	{
+		~Buffer()
+		{
+			if (fd.isValid())
+				munmap(mem, size);
+			else
+				delete[] mem;
+		}
+
+		libcamera::UniqueFD fd;
+		uint8_t *mem;
+		size_t size;
+	};
+
+	Buffer *Get(size_t frame_size)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (frame_size != size)
+		{
+			free.clear();
+			size = frame_size;
+		}
+		if (!free.empty())
+		{
+			Buffer *buffer = free.back().release();
+			free.pop_back();
+			return buffer;
+		}
+
+		auto buffer = std::make_unique<Buffer>();
+		buffer->size = size;
+		if (heap.isValid())
+			buffer->fd = heap.alloc("rotated", size);
+		if (buffer->fd.isValid())
+		{
+			void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd.get(), 0);
+			if (mem == MAP_FAILED)
+				throw std::runtime_error("failed to map rotated frame buffer");
+			buffer->mem = static_cast<uint8_t *>(mem);
+		}
+		else
+			buffer->mem = new uint8_t[size];
+
+		// Should settle at however many frames the encoder and writers hang on to.
+		LOG(2, "Allocated rotated frame buffer " << ++count << " of " << size << " bytes");
+		return buffer.release();
+	}
+
+	void Put(Buffer *buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (buffer->size == size)
+			free.emplace_back(buffer);
+		else
+			delete buffer;
+	}
+
+	DmaHeap heap;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Buffer>> free;
+	size_t size = 0;
+	unsigned int count = 0;
+};
+
+// Rotate the 8x8 block at src. Source column i becomes the destination row at dst + i * dst_step.
+template <bool Clockwise>
+static inline void rotate_block(uint8_t const *src, unsigned int src_stride, uint8_t *dst, ptrdiff_t dst_step)
+{
+#if defined(__ARM_NEON)
+	uint8x8_t r0 = vld1_u8(src);
+	uint8x8_t r1 = vld1_u8(src + src_stride);
+	uint8x8_t r2 = vld1_u8(src + 2 * src_stride);
+	uint8x8_t r3 = vld1_u8(src + 3 * src_stride);
+	uint8x8_t r4 = vld1_u8(src + 4 * src_stride);
+	uint8x8_t r5 = vld1_u8(src + 5 * src_stride);
+	uint8x8_t r6 = vld1_u8(src + 6 * src_stride);
+	uint8x8_t r7 = vld1_u8(src + 7 * src_stride);
+
+	// Swap bytes, then pairs of bytes, then fours, between neighbouring rows.
+	uint8x8x2_t b01 = vtrn_u8(r0, r1);
+	uint8x8x2_t b23 = vtrn_u8(r2, r3);
+	uint8x8x2_t b45 = vtrn_u8(r4, r5);
+	uint8x8x2_t b67 = vtrn_u8(r6, r7);
+
+	uint16x4x2_t h02 = vtrn_u16(vreinterpret_u16_u8(b01.val[0]), vreinterpret_u16_u8(b23.val[0]));
+	uint16x4x2_t h13 = vtrn_u16(vreinterpret_u16_u8(b01.val[1]), vreinterpret_u16_u8(b23.val[1]));
+	uint16x4x2_t h46 = vtrn_u16(vreinterpret_u16_u8(b45.val[0]), vreinterpret_u16_u8(b67.val[0]));
+	uint16x4x2_t h57 = vtrn_u16(vreinterpret_u16_u8(b45.val[1]), vreinterpret_u16_u8(b67.val[1]));
+
+	uint32x2x2_t w04 = vtrn_u32(vreinterpret_u32_u16(h02.val[0]), vreinterpret_u32_u16(h46.val[0]));
+	uint32x2x2_t w15 = vtrn_u32(vreinterpret_u32_u16(h13.val[0]), vreinterpret_u32_u16(h57.val[0]));
+	uint32x2x2_t w26 = vtrn_u32(vreinterpret_u32_u16(h02.val[1]), vreinterpret_u32_u16(h46.val[1]));
+	uint32x2x2_t w37 = vtrn_u32(vreinterpret_u32_u16(h13.val[1]), vreinterpret_u32_u16(h57.val[1]));
+
+	uint8x8_t c[8] = { vreinterpret_u8_u32(w04.val[0]), vreinterpret_u8_u32(w15.val[0]),
+					   vreinterpret_u8_u32(w26.val[0]), vreinterpret_u8_u32(w37.val[0]),
+					   vreinterpret_u8_u32(w04.val[1]), vreinterpret_u8_u32(w15.val[1]),
+					   vreinterpret_u8_u32(w26.val[1]), vreinterpret_u8_u32(w37.val[1]) };
+	for (int i = 0; i < 8; i++)
+		vst1_u8(dst + i * dst_step, Clockwise ? vrev64_u8(c[i]) : c[i]);
+#else
+	for (int i = 0; i < 8; i++)
+		for (int j = 0; j < 8; j++)
+			dst[i * dst_step + (Clockwise ? 7 - j : j)] = src[j * src_stride + i];
+#endif
+}
+
+// One pixel at a time, for the edges that don't fill a block.
+template <bool Clockwise>
+static void rotate_pixels(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+						  unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1, uint8_t *dst,
+						  unsigned int dst_stride)
+{
+	for (unsigned int y = y0; y < y1; y++)
+	{
+		for (unsigned int x = x0; x < x1; x++)
+		{
+			size_t offset = Clockwise ? x * dst_stride + (height - 1 - y) : (width - 1 - x) * dst_stride + y;
+			dst[offset] = src[y * src_stride + x];
+		}
+	}
+}
+
+template <bool Clockwise>
+static void rotate_plane(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+						 uint8_t *dst, unsigned int dst_stride)
+{
+	// Going across the source a block at a time goes down the destination, touching a new cache
+	// line in every row. Tiles this size keep all of those lines in L1 until they are filled.
+	constexpr unsigned int TILE = 64;
+	unsigned int width8 = width & ~7;
+	unsigned int height8 = height & ~7;
+
+	for (unsigned int ty = 0; ty < height8; ty += TILE)
+	{
+		unsigned int y_end = std::min(ty + TILE, height8);
+		for (unsigned int tx = 0; tx < width8; tx += TILE)
+		{
+			unsigned int x_end = std::min(tx + TILE, width8);
+			for (unsigned int y = ty; y < y_end; y += 8)
+			{
+				for (unsigned int x = tx; x < x_end; x += 8)
+				{
+					uint8_t const *block = src + y * src_stride + x;
+					if (Clockwise)
+						rotate_block<true>(block, src_stride, dst + x * dst_stride + (height - 8 - y), dst_stride);
+					else
+						rotate_block<false>(block, src_stride, dst + (width - 1 - x) * dst_stride + y,
+											-(ptrdiff_t)dst_stride);
+				}
+			}
+		}
+	}
+
+	rotate_pixels<Clockwise>(src, src_stride, width, height, width8, width, 0, height, dst, dst_stride);
+	rotate_pixels<Clockwise>(src, src_stride, width, height, 0, width8, height8, height, dst, dst_stride);
+}
+
+FrameRotator::FrameRotator(int rotation) : rotation_(rotation), pool_(std::make_shared<Pool>())
+{
+	if (rotation != 90 && rotation != 270)
+		throw std::runtime_error("can only rotate by 90 or 270 degrees");
+}
+
+FrameRotator::~FrameRotator()
+{
+}
+
+StreamInfo FrameRotator::Rotated(StreamInfo const &info)
+{
+	StreamInfo rotated = info;
+	rotated.width = info.height;
+	rotated.height = info.width;
+	// Same alignment as the camera gives us, so the chroma rows are still 32 byte aligned.
+	rotated.stride = (rotated.width + 63) & ~63;
+	return rotated;
+}
+
+void FrameRotator::RotatePlane(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+							   uint8_t *dst, unsigned int dst_stride, int rotation)
+{
+	if (rotation == 90)
+		rotate_plane<true>(src, src_stride, width, height, dst, dst_stride);
+	else
+		rotate_plane<false>(src, src_stride, width, height, dst, dst_stride);
+}
+
+FrameRotator::FramePtr FrameRotator::Rotate(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info)
+{
+	if (info.pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("can only rotate YUV420 frames");
+
+	StreamInfo rotated = Rotated(info);
+	size_t size = rotated.stride * rotated.height * 3 / 2;
+	Pool::Buffer *buffer = pool_->Get(size);
+	FramePtr frame(new Frame { buffer->fd.isValid() ? buffer->fd.get() : -1, { { buffer->mem, size } }, rotated },
+				   [pool = pool_, buffer](Frame *frame) {
+					   pool->Put(buffer);
+					   delete frame;
+				   });
+
+	dma_buf_sync sync = {};
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE;
+	if (frame->fd >= 0 && ioctl(frame->fd, DMA_BUF_IOCTL_SYNC, &sync))
+		LOG_ERROR("failed to lock-sync-write rotated frame");
+
+	uint8_t const *Y = mem[0].data();
+	uint8_t const *U = Y + info.stride * info.height;
+	uint8_t const *V = U + (info.stride / 2) * (info.height / 2);
+	uint8_t *dst_Y = buffer->mem;
+	uint8_t *dst_U = dst_Y + rotated.stride * rotated.height;
+	uint8_t *dst_V = dst_U + (rotated.stride / 2) * (rotated.height / 2);
+
+	RotatePlane(Y, info.stride, info.width, info.height, dst_Y, rotated.stride, rotation_);
+	RotatePlane(U, info.stride / 2, info.width / 2, info.height / 2, dst_U, rotated.stride / 2, rotation_);
+	RotatePlane(V, info.stride / 2, info.width / 2, info.height / 2, dst_V, rotated.stride / 2, rotation_);
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+	if (frame->fd >= 0 && ioctl(frame->fd, DMA_BUF_IOCTL_SYNC, &sync))
+		LOG_ERROR("failed to unlock-sync-write rotated frame");
+
+	return frame;
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_rotator.hpp - rotate YUV420 frames by 90 or 270 degrees.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <libcamera/base/span.h>
+
+#include "core/stream_info.hpp"
+
+// The ISP can only flip, so the quarter turns are done here: each plane is transposed (and
+// mirrored) a block at a time, using NEON where we have it. The rotated frames go into
+// dma-bufs from a pool, so they can be handed to the hardware encoder just like camera buffers.
+class FrameRotator
+{
+public:
+	struct Frame
+	{
+		// -1 if no dma-heap could be opened, only the software encoders can use those.
+		int fd;
+		// Laid out like a camera buffer: one span, the U and V planes following on from Y.
+		std::vector<libcamera::Span<uint8_t>> mem;
+		StreamInfo info;
+	};
+	// Goes back to the pool when released, which may be after the rotator is gone.
+	typedef std::shared_ptr<Frame> FramePtr;
+
+	// Clockwise, only 90 or 270.
+	FrameRotator(int rotation);
+	~FrameRotator();
+
+	int Rotation() const { return rotation_; }
+
+	// What a frame of this stream looks like once rotated.
+	static StreamInfo Rotated(StreamInfo const &info);
+
+	// Rotate a YUV420 frame into a buffer from the pool.
+	FramePtr Rotate(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info);
+
+	// Rotate one plane, which must not overlap the destination. The destination is height wide
+	// and width high.
+	static void RotatePlane(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+							uint8_t *dst, unsigned int dst_stride, int rotation);
+
+private:
+	struct Pool;
+
+	int rotation_;
+	std::shared_ptr<Pool> pool_;
+};
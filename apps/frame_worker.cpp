@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_worker.cpp - hand completed requests to one consumer in its own thread.
+ */
+
+#include <algorithm>
+#include <sstream>
+
+#include "core/logging.hpp"
+
+#include "frame_worker.hpp"
+
+FrameWorker::FrameWorker(std::string const &name, size_t depth, Handler handler, bool warn_on_drop)
+	: name_(name), depth_(std::max<size_t>(depth, 1)), handler_(handler), warn_on_drop_(warn_on_drop)
+{
+	thread_ = std::thread(&FrameWorker::workThread, this);
+}
+
+FrameWorker::~FrameWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	thread_.join();
+
+	LOG(2, "Frame worker " << name_ << " handled " << handled_ << ", dropped " << dropped_);
+}
+
+void FrameWorker::Submit(CompletedRequestPtr const &completed_request)
+{
+	CompletedRequestPtr dropped;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (queue_.size() >= depth_)
+		{
+			dropped = std::move(queue_.front().completed_request);
+			queue_.pop_front();
+			dropped_++;
+		}
+		queue_.push_back({ completed_request, std::chrono::steady_clock::now() });
+		cond_var_.notify_one();
+	}
+
+	// Letting go of it here hands the buffer back to the camera (unless someone else has it).
+	unsigned int suppressed;
+	if (dropped && (warn_on_drop_ || RPiCamApp::GetVerbosity() >= 1) && logging::Allow(drop_limit_, 1000, suppressed))
+	{
+		std::stringstream message;
+		message << "Frame worker " << name_ << " is behind, dropped frame " << dropped->sequence;
+		if (suppressed)
+			message << " (" << suppressed << " more suppressed)";
+		if (warn_on_drop_)
+			LOG_ERROR("WARNING: " << message.str());
+		else
+			LOG(1, message.str());
+	}
+}
+
+void FrameWorker::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_cond_var_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+std::string FrameWorker::Report()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::stringstream report;
+	auto mean = latency_count_ ? latency_total_.count() / latency_count_ : 0;
+	report << name_ << ": " << handled_ - handled_reported_ << " handled, " << dropped_ - dropped_reported_
+		   << " dropped, latency " << mean << "us mean, " << latency_max_.count() << "us worst";
+	handled_reported_ = handled_;
+	dropped_reported_ = dropped_;
+	latency_total_ = latency_max_ = std::chrono::microseconds(0);
+	latency_count_ = 0;
+	return report.str();
+}
+
+void FrameWorker::workThread()
+{
+	while (true)
+	{
+		Item item;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			busy_ = false;
+			idle_cond_var_.notify_all();
+			cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			item = std::move(queue_.front());
+			queue_.pop_front();
+			busy_ = true;
+		}
+
+		try
+		{
+			handler_(item.completed_request);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Frame worker " << name_ << " failed on frame " << item.completed_request->sequence << ": "
+									  << e.what());
+		}
+
+		auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+																			 item.submitted);
+		// Let go of the request before anyone waiting on a Flush() hears about it.
+		item.completed_request.reset();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		handled_++;
+		latency_total_ += latency;
+		latency_max_ = std::max(latency_max_, latency);
+		latency_count_++;
+	}
+}
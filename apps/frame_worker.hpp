@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * frame_worker.hpp - hand completed requests to one consumer in its own thread.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "core/completed_request.hpp"
+#include "core/logging.hpp"
+
+// Each consumer of the frames (video, motion detection...) gets one of these, so a slow one
+// holds up neither the event loop nor the others. The worker holds a reference on each request
+// it is given, and the buffers go back to the camera once the last consumer lets go. The queue is
+// bounded: when it is full the oldest request waiting is dropped.
+class FrameWorker
+{
+public:
+	typedef std::function<void(CompletedRequestPtr &)> Handler;
+
+	// Drops are logged at most once a second, as warnings if warn_on_drop is set (for consumers
+	// where a dropped frame is lost output, not just a late one).
+	FrameWorker(std::string const &name, size_t depth, Handler handler, bool warn_on_drop = false);
+	// Anything still queued is handled first.
+	~FrameWorker();
+
+	void Submit(CompletedRequestPtr const &completed_request);
+	// Wait until everything submitted so far has been handled. Call before changing anything the
+	// handler uses.
+	void Flush();
+
+	// Requests handled and dropped, and the mean and worst time from Submit() to handled, since
+	// the last call. The destructor logs the totals.
+	std::string Report();
+
+private:
+	struct Item
+	{
+		CompletedRequestPtr completed_request;
+		std::chrono::steady_clock::time_point submitted;
+	};
+
+	void workThread();
+
+	std::string name_;
+	size_t depth_;
+	Handler handler_;
+	bool warn_on_drop_;
+	logging::RateLimit drop_limit_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::condition_variable idle_cond_var_;
+	std::deque<Item> queue_;
+	bool busy_ = false;
+	bool abort_ = false;
+	uint64_t handled_ = 0;
+	uint64_t dropped_ = 0;
+	uint64_t handled_reported_ = 0;
+	uint64_t dropped_reported_ = 0;
+	std::chrono::microseconds latency_total_ { 0 };
+	std::chrono::microseconds latency_max_ { 0 };
+	uint64_t latency_count_ = 0;
+	std::thread thread_;
+};
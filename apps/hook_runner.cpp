@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * hook_runner.cpp - run the RaspiMJPEG macros (start_img, end_vid...) in the background.
+ */
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "hook_runner.hpp"
+
+extern char **environ;
+
+HookRunner::HookRunner(std::string const &macros_path, std::chrono::seconds timeout)
+	: macros_path_(macros_path), timeout_(timeout)
+{
+	for (unsigned int i = 0; i < WORKERS; i++)
+		threads_.emplace_back(&HookRunner::workerThread, this);
+}
+
+HookRunner::~HookRunner()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	for (auto &thread : threads_)
+		thread.join();
+}
+
+void HookRunner::Run(std::string const &macro, std::vector<std::string> const &args)
+{
+	if (macro.empty() || macro[0] == '-')
+		return;
+
+	Job job;
+	job.ordered = macro[0] != '&';
+	job.name = job.ordered ? macro : macro.substr(1);
+	job.argv.push_back(job.name[0] == '/' || macros_path_.empty() ? job.name : macros_path_ + "/" + job.name);
+	job.argv.insert(job.argv.end(), args.begin(), args.end());
+	job.queued = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (queue_.size() >= MAX_QUEUED)
+	{
+		dropped_++;
+		LOG_ERROR("Too many macros waiting, dropped " << job.name << " (" << dropped_.load() << " dropped so far)");
+		return;
+	}
+	queue_.push_back(std::move(job));
+	cond_var_.notify_one();
+}
+
+size_t HookRunner::Queued()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return queue_.size();
+}
+
+void HookRunner::workerThread()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		// Take the oldest job we're allowed to start: an ordered one must wait for the one before.
+		auto runnable = [this]() {
+			return std::find_if(queue_.begin(), queue_.end(),
+								[this](Job const &job) { return !job.ordered || !ordered_running_; });
+		};
+		// Must check the queue before the abort, so that everything gets run.
+		cond_var_.wait(lock, [&]() { return runnable() != queue_.end() || (abort_ && queue_.empty()); });
+		if (queue_.empty())
+			return;
+
+		auto it = runnable();
+		Job job = std::move(*it);
+		queue_.erase(it);
+		if (job.ordered)
+			ordered_running_ = true;
+
+		lock.unlock();
+		run(job);
+		lock.lock();
+
+		if (job.ordered)
+		{
+			ordered_running_ = false;
+			cond_var_.notify_all();
+		}
+	}
+}
+
+void HookRunner::run(Job const &job)
+{
+	std::vector<char *> argv;
+	for (auto const &arg : job.argv)
+		argv.push_back(const_cast<char *>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	// In its own process group, so a timeout kills anything the script started too.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid;
+	int ret = posix_spawn(&pid, argv[0], nullptr, &attr, argv.data(), environ);
+	posix_spawnattr_destroy(&attr);
+	if (ret)
+	{
+		// Most of the macros in the stock config are usually not there.
+		if (ret == ENOENT)
+			LOG(2, "Macro " << argv[0] << " not found");
+		else
+			LOG_ERROR("Failed to run macro " << argv[0] << ": " << strerror(ret));
+		return;
+	}
+
+	int status = wait(pid, job.name);
+	auto end = std::chrono::steady_clock::now();
+	auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(start - job.queued);
+	auto ran = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	if (status < 0)
+		return;
+	LOG(1, "Macro " << job.name << " exited with " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << " after "
+					<< ran.count() << "ms (waited " << waited.count() << "ms to start)");
+}
+
+// Returns the exit status, or -1 if it had to be killed.
+int HookRunner::wait(pid_t pid, std::string const &name)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout_;
+	// Only ever a few macros running, so polling is simpler than a SIGCHLD handler.
+	std::chrono::milliseconds poll { 1 };
+	while (true)
+	{
+		int status;
+		pid_t done = waitpid(pid, &status, WNOHANG);
+		if (done == pid)
+			return status;
+		if (done < 0 && errno != EINTR)
+		{
+			LOG_ERROR("Lost track of macro " << name << ": " << strerror(errno));
+			return -1;
+		}
+
+		if (timeout_.count() && std::chrono::steady_clock::now() >= deadline)
+			break;
+		std::this_thread::sleep_for(poll);
+		poll = std::min(poll * 2, std::chrono::milliseconds(50));
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	timed_out_++;
+	LOG_ERROR("Macro " << name << " still running after " << timeout_.count() << "s, killed (" << timed_out_.load()
+					   << " timed out so far)");
+	kill(-pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+	return -1;
+}
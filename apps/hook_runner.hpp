@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * hook_runner.hpp - run the RaspiMJPEG macros (start_img, end_vid...) in the background.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs macro scripts from macros_path with posix_spawn, from a small pool of worker threads,
+// so the frame loop never waits for one. As in RaspiMJPEG's config, a macro whose name starts
+// with '&' may run alongside anything else; the others run one at a time, in the order they
+// were asked for. Macros running longer than the timeout are killed, and if too many are
+// waiting new ones are dropped rather than piling up.
+class HookRunner
+{
+public:
+	static constexpr unsigned int WORKERS = 2;
+	static constexpr size_t MAX_QUEUED = 16;
+
+	// A zero timeout means macros may run for as long as they like.
+	HookRunner(std::string const &macros_path, std::chrono::seconds timeout);
+	// Anything still queued is run first.
+	~HookRunner();
+
+	// Run the macro with the given arguments. An empty name, or one starting with '-', is disabled.
+	void Run(std::string const &macro, std::vector<std::string> const &args = {});
+
+	// Waiting to run, not counting those running now.
+	size_t Queued();
+	unsigned int Dropped() const { return dropped_; }
+	unsigned int TimedOut() const { return timed_out_; }
+
+private:
+	struct Job
+	{
+		std::string name;
+		std::vector<std::string> argv;
+		bool ordered;
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	void workerThread();
+	void run(Job const &job);
+	int wait(pid_t pid, std::string const &name);
+
+	std::string macros_path_;
+	std::chrono::seconds timeout_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::deque<Job> queue_;
+	bool ordered_running_ = false;
+	bool abort_ = false;
+	std::atomic<unsigned int> dropped_ { 0 };
+	std::atomic<unsigned int> timed_out_ { 0 };
+	std::vector<std::thread> threads_;
+};
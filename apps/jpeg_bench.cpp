@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * jpeg_bench.cpp - time the JPEG encoders that stills and MJPEG video use.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include <libcamera/formats.h>
+
+#include "core/rpicam_app.hpp"
+#include "core/video_options.hpp"
+#include "encoder/mjpeg_encoder.hpp"
+#include "image/image.hpp"
+
+// Decode the JPEG with libjpeg and compare its luma against the image we gave the encoder. Anything
+// that doesn't decode, comes out the wrong size or looks nothing like the input is an error.
+struct DecodeError
+{
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+};
+
+static void check(std::string const &what, const uint8_t *jpeg, size_t size, std::vector<uint8_t> const &image,
+				  StreamInfo const &info)
+{
+	struct jpeg_decompress_struct cinfo;
+	DecodeError error;
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = [](j_common_ptr cinfo) {
+		DecodeError *error = (DecodeError *)cinfo->err;
+		(*cinfo->err->format_message)(cinfo, error->message);
+		longjmp(error->jump, 1);
+	};
+	jpeg_create_decompress(&cinfo);
+	if (setjmp(error.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		throw std::runtime_error(what + " output doesn't decode: " + error.message);
+	}
+
+	jpeg_mem_src(&cinfo, jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_YCbCr;
+	jpeg_start_decompress(&cinfo);
+	unsigned int width = cinfo.output_width, height = cinfo.output_height;
+	double squared = 0;
+	if (width == info.width && height == info.height)
+	{
+		std::vector<uint8_t> row(width * 3);
+		while (cinfo.output_scanline < height)
+		{
+			const uint8_t *y = image.data() + cinfo.output_scanline * info.stride;
+			JSAMPROW rows[1] = { row.data() };
+			jpeg_read_scanlines(&cinfo, rows, 1);
+			for (unsigned int x = 0; x < width; x++)
+				squared += (row[x * 3] - y[x]) * (row[x * 3] - y[x]);
+		}
+		jpeg_finish_decompress(&cinfo);
+	}
+	jpeg_destroy_decompress(&cinfo);
+
+	if (width != info.width || height != info.height)
+		throw std::runtime_error(what + " output decodes as " + std::to_string(width) + "x" + std::to_string(height));
+	double psnr = 10 * std::log10(255.0 * 255.0 * width * height / std::max(squared, 1.0));
+	if (psnr < 30)
+		throw std::runtime_error(what + " output decodes to something else, luma PSNR " + std::to_string(psnr) + "dB");
+}
+
+static void report(std::string const &what, unsigned int frames, std::function<size_t()> const &encode,
+				   uint8_t *const &buffer, std::vector<uint8_t> const &image, StreamInfo const &info)
+{
+	// Once to warm the caches (and size the buffers), and to check what comes out.
+	size_t size = encode();
+	check(what, buffer, size, image, info);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < frames; i++)
+		encode();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+	std::cout << "  " << what << ": " << ms << "ms per frame, " << 1000 / ms << " fps, " << size << " bytes"
+			  << std::endl;
+}
+
+// The MJPEG encoder as rpicam-mjpeg records with it, so with one thread per core and as many frames
+// in flight as the camera would let it have. This is frames through it per second, not per frame.
+static void report_encoder(unsigned int frames, int quality, std::vector<uint8_t> &image, StreamInfo const &info)
+{
+	VideoOptions options;
+	options.quality = quality;
+	options.encoder_threads = 0;
+	options.encoder_queue = 16;
+	options.encoder_drop = "block";
+	options.jpeg_bands = 1;
+
+	std::mutex mutex;
+	std::condition_variable cond_var;
+	unsigned int output = 0;
+	std::vector<uint8_t> jpeg;
+	std::chrono::steady_clock::time_point start;
+	{
+		MjpegEncoder encoder(&options, info);
+		encoder.SetInputDoneCallback([](void *) {});
+		encoder.SetOutputReadyCallback([&](void *mem, size_t bytes, int64_t, bool) {
+			std::lock_guard<std::mutex> lock(mutex);
+			output++;
+			jpeg.assign((uint8_t *)mem, (uint8_t *)mem + bytes);
+			cond_var.notify_one();
+		});
+
+		auto run = [&](unsigned int n) {
+			for (unsigned int i = 0; i < n; i++)
+				encoder.EncodeBuffer(-1, image.size(), image.data(), info, i);
+			std::unique_lock<std::mutex> lock(mutex);
+			cond_var.wait(lock, [&]() { return output == n; });
+			output = 0;
+		};
+		// Warm up every thread first.
+		run(std::thread::hardware_concurrency() * 2);
+		start = std::chrono::steady_clock::now();
+		run(frames);
+	}
+	check("MjpegEncoder", jpeg.data(), jpeg.size(), image, info);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+	std::cout << "  MjpegEncoder, " << std::thread::hardware_concurrency() << " threads: " << ms << "ms per frame, "
+			  << 1000 / ms << " fps, " << jpeg.size() << " bytes" << std::endl;
+}
+
+static void bench(unsigned int width, unsigned int height, unsigned int frames, int quality)
+{
+	StreamInfo info;
+	info.width = width;
+	info.height = height;
+	info.stride = (width + 63) & ~63;
+	info.buffer_count = 6;
+	info.pixel_format = libcamera::formats::YUV420;
+
+	// Smooth gradients with some noise, so there's something to compress but not too much.
+	std::vector<uint8_t> image(info.stride * info.height * 3 / 2);
+	for (size_t i = 0; i < image.size(); i++)
+		image[i] = (i % info.stride + i / info.stride) / 4 + (std::rand() & 7);
+
+	uint8_t *buffer = nullptr;
+	size_t buffer_size = 0;
+	std::cout << width << "x" << height << " at quality " << quality << std::endl;
+	report("libjpeg", frames,
+		   [&]() { return YUV420_to_JPEG_libjpeg(image.data(), info, quality, 0, buffer, buffer_size); },
+		   buffer, image, info);
+#if TURBOJPEG_PRESENT
+	report("TurboJPEG", frames,
+		   [&]() { return YUV420_to_JPEG_turbo(image.data(), info, quality, buffer, buffer_size); }, buffer,
+		   image, info);
+#endif
+	report("libjpeg, a band per core", frames,
+		   [&]() { return YUV420_to_JPEG_bands(image.data(), info, quality, 0, buffer, buffer_size); }, buffer,
+		   image, info);
+	report_encoder(frames, quality, image, info);
+	free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	RPiCamApp::verbosity = 1;
+
+	unsigned int frames = argc > 1 ? std::atoi(argv[1]) : 20;
+	int quality = argc > 2 ? std::atoi(argv[2]) : 85;
+
+#if TURBOJPEG_PRESENT
+	std::cout << "Built with TurboJPEG, which MjpegEncoder uses" << std::endl;
+#else
+	std::cout << "Built without TurboJPEG, MjpegEncoder uses libjpeg" << std::endl;
+#endif
+
+	try
+	{
+		for (auto [width, height] : { std::pair(640u, 480u), std::pair(1920u, 1080u), std::pair(4056u, 3040u) })
+			bench(width, height, frames, quality);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * media_index.cpp - remember the media counters without scanning the media directory.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "core/logging.hpp"
+
+#include "media_index.hpp"
+
+// Fixed width, so the stamp can be rewritten in place.
+static constexpr char const *HEADER_FORMAT = "rpicam-mjpeg-index 1 %020lld %09ld\n";
+static constexpr char const *HEADER_SCAN = "rpicam-mjpeg-index 1 %lld %ld";
+static constexpr char const *THUMBNAIL_SUFFIX = ".th.jpg";
+
+MediaIndex::MediaIndex(std::string const &dir) : dir_(dir), path_(dir + "/" + FILENAME)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!load())
+		rebuild();
+}
+
+void MediaIndex::Validate()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	timespec mtime;
+	if (dirMtime(mtime) && mtime.tv_sec == stamp_.tv_sec && mtime.tv_nsec == stamp_.tv_nsec)
+		return;
+
+	LOG(1, "Media index for " << dir_ << " is out of date");
+	rebuild();
+}
+
+int MediaIndex::Highest(std::string const &types)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	int highest = 0;
+	for (char type : types)
+	{
+		auto it = highest_.find(type);
+		if (it != highest_.end())
+			highest = std::max(highest, it->second);
+	}
+	return highest;
+}
+
+void MediaIndex::AddThumbnail(std::string const &filename)
+{
+	char type;
+	int count;
+	if (!ParseThumbnail(filename, type, count))
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	update(type, count);
+	thumbnails_++;
+	append("t " + std::filesystem::path(filename).filename().string() + "\n");
+}
+
+void MediaIndex::AddMedia(char type, int count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	update(type, count);
+	append(std::string("c ") + type + " " + std::to_string(count) + "\n");
+}
+
+void MediaIndex::Stamp()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!dirMtime(stamp_))
+		return;
+
+	int fd = open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	writeStamp(fd);
+	close(fd);
+}
+
+size_t MediaIndex::Thumbnails()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return thumbnails_;
+}
+
+bool MediaIndex::ParseThumbnail(std::string const &filename, char &type, int &count)
+{
+	// "<name>.<type><count>.th.jpg"
+	size_t suffix_len = std::char_traits<char>::length(THUMBNAIL_SUFFIX);
+	if (filename.size() <= suffix_len || filename.compare(filename.size() - suffix_len, suffix_len, THUMBNAIL_SUFFIX))
+		return false;
+
+	size_t end = filename.size() - suffix_len;
+	size_t dot = filename.rfind('.', end - 1);
+	if (dot == std::string::npos || end - dot < 3 || end - dot > 11)
+		return false;
+
+	type = filename[dot + 1];
+	if (type != 'i' && type != 't' && type != 'v')
+		return false;
+
+	count = 0;
+	for (size_t i = dot + 2; i < end; i++)
+	{
+		if (filename[i] < '0' || filename[i] > '9')
+			return false;
+		count = count * 10 + (filename[i] - '0');
+	}
+	return true;
+}
+
+bool MediaIndex::load()
+{
+	std::ifstream file(path_, std::ios::binary);
+	if (!file)
+		return false;
+	std::stringstream contents;
+	contents << file.rdbuf();
+	std::string const text = contents.str();
+
+	long long sec;
+	long nsec;
+	size_t header_end = text.find('\n');
+	if (header_end == std::string::npos || sscanf(text.c_str(), HEADER_SCAN, &sec, &nsec) != 2)
+		return false;
+
+	timespec mtime;
+	if (!dirMtime(mtime) || mtime.tv_sec != sec || mtime.tv_nsec != nsec)
+	{
+		LOG(1, "Media index for " << dir_ << " is out of date");
+		return false;
+	}
+
+	for (size_t pos = header_end + 1; pos < text.size();)
+	{
+		size_t eol = text.find('\n', pos);
+		// A partial last line means we stopped part way through writing it.
+		if (eol == std::string::npos)
+			return false;
+		std::string const line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		char type;
+		int count;
+		if (line.compare(0, 2, "t ") == 0 && ParseThumbnail(line.substr(2), type, count))
+			thumbnails_++;
+		else if (sscanf(line.c_str(), "c %c %d", &type, &count) != 2)
+			return false;
+		update(type, count);
+	}
+
+	stamp_ = mtime;
+	LOG(2, "Loaded media index for " << dir_ << ": " << thumbnails_ << " thumbnails");
+	return true;
+}
+
+void MediaIndex::rebuild()
+{
+	highest_.clear();
+	thumbnails_ = 0;
+
+	std::string entries;
+	for (auto const &dir_entry : std::filesystem::directory_iterator(dir_))
+	{
+		if (!dir_entry.is_regular_file())
+			continue;
+
+		std::string const filename = dir_entry.path().filename();
+		char type;
+		int count;
+		if (!ParseThumbnail(filename, type, count))
+			continue;
+
+		update(type, count);
+		thumbnails_++;
+		entries += "t " + filename + "\n";
+	}
+	LOG(1, "Rebuilt media index for " << dir_ << ": " << thumbnails_ << " thumbnails");
+
+	// Renaming the new index into place changes the directory's mtime, so only stamp it after.
+	std::string const tmp_path = path_ + ".part";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		LOG_ERROR("Cannot create media index " << tmp_path);
+		dirMtime(stamp_);
+		return;
+	}
+
+	// Leave room for the stamp, which we don't know yet.
+	char header[64];
+	entries.insert(0, header, snprintf(header, sizeof(header), HEADER_FORMAT, 0LL, 0L));
+	bool ok = write(fd, entries.data(), entries.size()) == (ssize_t)entries.size();
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp_path.c_str(), path_.c_str()) != 0)
+	{
+		LOG_ERROR("Cannot write media index " << path_);
+		unlink(tmp_path.c_str());
+		dirMtime(stamp_);
+		return;
+	}
+
+	dirMtime(stamp_);
+	fd = open(path_.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		writeStamp(fd);
+		close(fd);
+	}
+}
+
+void MediaIndex::append(std::string const &line)
+{
+	// Never create the file here, that would change the directory's mtime behind our back.
+	int fd = open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (write(fd, line.data(), line.size()) != (ssize_t)line.size())
+		LOG_ERROR("Cannot update media index " << path_);
+	close(fd);
+}
+
+void MediaIndex::writeStamp(int fd)
+{
+	char header[64];
+	int len = snprintf(header, sizeof(header), HEADER_FORMAT, (long long)stamp_.tv_sec, (long)stamp_.tv_nsec);
+	if (pwrite(fd, header, len, 0) != len)
+		LOG_ERROR("Cannot update media index " << path_);
+}
+
+bool MediaIndex::dirMtime(timespec &mtime) const
+{
+	struct stat st;
+	if (stat(dir_.c_str(), &st) != 0)
+		return false;
+	mtime = st.st_mtim;
+	return true;
+}
+
+void MediaIndex::update(char type, int count)
+{
+	int &highest = highest_[type];
+	highest = std::max(highest, count);
+}
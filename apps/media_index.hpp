@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * media_index.hpp - remember the media counters without scanning the media directory.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// An index of the thumbnails and media counters in one directory, kept in a hidden file in
+// that directory. Entries are only ever appended to it, and its header records the directory's
+// mtime when we last knew the two to agree. If the directory has changed since (files deleted
+// from the web interface, say) the index is rebuilt by scanning the directory once.
+//
+// NOTE: writing to the index file in place doesn't touch the directory's mtime, but creating,
+// renaming or deleting files does. So call Stamp() after saving our own files.
+class MediaIndex
+{
+public:
+	static constexpr char const *FILENAME = ".rpicam-mjpeg.index";
+
+	// Loads the index for the directory, or builds it if missing or out of date.
+	MediaIndex(std::string const &dir);
+
+	// Check the index still matches the directory, rebuilding it if not.
+	void Validate();
+
+	// Highest count among the given types (any of "itv"), 0 if there are none.
+	int Highest(std::string const &types);
+
+	// Record a thumbnail saved as "<name>.<type><count>.th.jpg".
+	void AddThumbnail(std::string const &filename);
+	// Record media saved with the given type and count, even if it has no thumbnail.
+	void AddMedia(char type, int count);
+
+	// Our own files have been written, so the directory as it is now matches the index.
+	void Stamp();
+
+	size_t Thumbnails();
+
+	// Get the type and count from a thumbnail filename.
+	static bool ParseThumbnail(std::string const &filename, char &type, int &count);
+
+private:
+	bool load();
+	void rebuild();
+	void append(std::string const &line);
+	void writeStamp(int fd);
+	bool dirMtime(timespec &mtime) const;
+	void update(char type, int count);
+
+	std::string dir_;
+	std::string path_;
+	std::mutex mutex_;
+	std::map<char, int> highest_;
+	size_t thumbnails_ = 0;
+	timespec stamp_ = {};
+};
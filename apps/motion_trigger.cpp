@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * motion_trigger.cpp - turn per-frame motion detection into start/stop events.
+ */
+
+#include <algorithm>
+
+#include "motion_trigger.hpp"
+
+MotionTrigger::MotionTrigger(unsigned int init_frames, unsigned int start_frames, unsigned int stop_frames,
+							 std::chrono::seconds clip)
+	: init_frames_(init_frames), start_frames_(std::max(start_frames, 1u)), stop_frames_(std::max(stop_frames, 1u)),
+	  clip_(clip)
+{
+	Reset();
+}
+
+void MotionTrigger::Reset()
+{
+	settling_ = init_frames_;
+	count_ = 0;
+	triggered_ = false;
+}
+
+MotionTrigger::Event MotionTrigger::Update(bool detected, std::chrono::steady_clock::time_point now)
+{
+	if (settling_)
+	{
+		settling_--;
+		return Event::None;
+	}
+
+	if (triggered_ && clip_.count() && now - started_ >= clip_)
+	{
+		triggered_ = false;
+		count_ = 0;
+		return Event::Stop;
+	}
+
+	// Count the frames in a row that disagree with where we are now.
+	count_ = detected != triggered_ ? count_ + 1 : 0;
+	if (count_ < (triggered_ ? stop_frames_ : start_frames_))
+		return Event::None;
+
+	count_ = 0;
+	triggered_ = !triggered_;
+	if (!triggered_)
+		return Event::Stop;
+
+	started_ = now;
+	return Event::Start;
+}
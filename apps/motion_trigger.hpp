@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * motion_trigger.hpp - turn per-frame motion detection into start/stop events.
+ */
+
+#pragma once
+
+#include <chrono>
+
+// The RaspiMJPEG motion recording rules: ignore the first motion_initframes frames while
+// things settle, start once motion has been seen for motion_startframes frames in a row, and
+// stop once it has been absent for motion_stopframes in a row. If motion_clip is set, no clip
+// runs longer than that, though continuing motion will start another.
+class MotionTrigger
+{
+public:
+	enum class Event
+	{
+		None,
+		Start,
+		Stop
+	};
+
+	MotionTrigger(unsigned int init_frames, unsigned int start_frames, unsigned int stop_frames,
+				  std::chrono::seconds clip);
+
+	// Start settling again, e.g. when motion detection is (re)enabled. Doesn't report a Stop.
+	void Reset();
+
+	// Call with every frame's detection result.
+	Event Update(bool detected, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+	bool Triggered() const { return triggered_; }
+
+private:
+	unsigned int init_frames_;
+	unsigned int start_frames_;
+	unsigned int stop_frames_;
+	std::chrono::seconds clip_;
+
+	unsigned int settling_ = 0;
+	// Consecutive frames that disagree with the current state.
+	unsigned int count_ = 0;
+	bool triggered_ = false;
+	std::chrono::steady_clock::time_point started_;
+};
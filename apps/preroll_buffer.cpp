@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preroll_buffer.cpp - hold the last few seconds of encoded video for the next recording.
+ */
+
+#include <cstring>
+
+#include "core/logging.hpp"
+#include "output/output.hpp"
+
+#include "preroll_buffer.hpp"
+
+PrerollBuffer::PrerollBuffer(std::chrono::milliseconds duration, size_t capacity)
+	: duration_(duration), buffer_(capacity)
+{
+	LOG(1, "Pre-roll buffer: " << duration.count() << "ms, " << (capacity >> 20) << "MB");
+}
+
+void PrerollBuffer::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Only drop a whole GOP once the next one alone covers the pre-roll.
+	while (keyframes_.size() >= 2)
+	{
+		Frame const &next_gop = frames_[keyframes_[1] - frames_.front().sequence];
+		if (timestamp_us - next_gop.timestamp_us < duration_.count())
+			break;
+		dropOldestGop();
+	}
+
+	size_t offset;
+	bool room;
+	while (!(room = allocate(size, offset)) && !frames_.empty())
+	{
+		if (!warned_full_)
+		{
+			LOG(1, "Pre-roll buffer full, holding less than " << duration_.count() / 1000 << "ms");
+			warned_full_ = true;
+		}
+		dropOldestGop();
+	}
+
+	if (!room)
+		LOG_ERROR("Pre-roll buffer too small for a " << size << " byte frame");
+	// Nothing before the first keyframe can be decoded, so don't keep it.
+	else if (keyframe || !frames_.empty())
+	{
+		memcpy(&buffer_[offset], mem, size);
+		if (keyframe)
+			keyframes_.push_back(sequence_);
+		frames_.push_back({ sequence_++, offset, size, timestamp_us });
+		mem = &buffer_[offset];
+	}
+
+	if (output_)
+		output_->OutputReady(mem, size, timestamp_us, keyframe);
+}
+
+void PrerollBuffer::Start(Output *output)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto next_keyframe = keyframes_.begin();
+	for (Frame const &frame : frames_)
+	{
+		bool keyframe = next_keyframe != keyframes_.end() && *next_keyframe == frame.sequence;
+		if (keyframe)
+			next_keyframe++;
+		output->OutputReady(&buffer_[frame.offset], frame.size, frame.timestamp_us, keyframe);
+	}
+	if (!frames_.empty())
+		LOG(1, "Recording starts with " << frames_.size() << " frames ("
+										<< (frames_.back().timestamp_us - frames_.front().timestamp_us) / 1000
+										<< "ms) of pre-roll");
+
+	output_ = output;
+}
+
+void PrerollBuffer::Stop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	output_ = nullptr;
+}
+
+void PrerollBuffer::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	frames_.clear();
+	keyframes_.clear();
+}
+
+std::chrono::milliseconds PrerollBuffer::Held()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (frames_.empty())
+		return std::chrono::milliseconds(0);
+	return std::chrono::milliseconds((frames_.back().timestamp_us - frames_.front().timestamp_us) / 1000);
+}
+
+// Find room for the frame after the newest one, without splitting it across the end of the ring,
+// so it can always be handed on as it is.
+bool PrerollBuffer::allocate(size_t size, size_t &offset)
+{
+	if (frames_.empty())
+	{
+		offset = 0;
+		return size <= buffer_.size();
+	}
+
+	size_t start = frames_.front().offset;
+	size_t end = frames_.back().offset + frames_.back().size;
+	if (end > start)
+	{
+		if (end + size <= buffer_.size())
+		{
+			offset = end;
+			return true;
+		}
+		offset = 0;
+		return size <= start;
+	}
+
+	offset = end;
+	return end + size <= start;
+}
+
+void PrerollBuffer::dropOldestGop()
+{
+	keyframes_.pop_front();
+	uint64_t until = keyframes_.empty() ? sequence_ : keyframes_.front();
+	while (!frames_.empty() && frames_.front().sequence < until)
+		frames_.pop_front();
+}
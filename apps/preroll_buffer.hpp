@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preroll_buffer.hpp - hold the last few seconds of encoded video for the next recording.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+class Output;
+
+// Sits between an always running encoder and the recording output. Encoded frames are copied
+// once into a fixed size ring, and an index of them (and of the keyframes) is kept so that
+// there is always at least the pre-roll duration available, starting on a keyframe. When a
+// recording starts the ring is written out to it straight from the ring, and from then on
+// frames are passed on as they arrive.
+class PrerollBuffer
+{
+public:
+	PrerollBuffer(std::chrono::milliseconds duration, size_t capacity);
+
+	// Called from the encoder's output thread.
+	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+
+	// Write out everything held, then keep passing frames on, until Stop().
+	void Start(Output *output);
+	void Stop();
+	// Forget everything, the encoder is being replaced.
+	void Clear();
+
+	// How much we would write out if a recording started now.
+	std::chrono::milliseconds Held();
+
+private:
+	struct Frame
+	{
+		uint64_t sequence;
+		size_t offset;
+		size_t size;
+		int64_t timestamp_us;
+	};
+
+	bool allocate(size_t size, size_t &offset);
+	void dropOldestGop();
+
+	std::chrono::microseconds duration_;
+	std::mutex mutex_;
+	std::vector<uint8_t> buffer_;
+	std::deque<Frame> frames_;
+	// Sequence numbers of the keyframes in frames_, which always starts with one.
+	std::deque<uint64_t> keyframes_;
+	uint64_t sequence_ = 0;
+	bool warned_full_ = false;
+	Output *output_ = nullptr;
+};
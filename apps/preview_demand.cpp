@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preview_demand.cpp - notice when someone reads the preview file.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <system_error>
+
+#include "core/logging.hpp"
+
+#include "preview_demand.hpp"
+
+PreviewDemand::PreviewDemand(std::string const &preview_path)
+	: last_read_(std::chrono::steady_clock::now().time_since_epoch().count())
+{
+	std::filesystem::path path(preview_path);
+	name_ = path.filename();
+	std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+
+	inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd_ < 0)
+		throw std::system_error(errno, std::generic_category(), "inotify_init1");
+
+	// Our own writes go to a temporary file that is renamed into place, so only
+	// readers open the preview itself.
+	if (inotify_add_watch(inotify_fd_, dir.c_str(), IN_OPEN | IN_ACCESS) < 0)
+	{
+		int err = errno;
+		close(inotify_fd_);
+		throw std::system_error(err, std::generic_category(), dir);
+	}
+
+	stop_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd_ < 0)
+	{
+		int err = errno;
+		close(inotify_fd_);
+		throw std::system_error(err, std::generic_category(), "eventfd");
+	}
+
+	watch_thread_ = std::thread(&PreviewDemand::watchThread, this);
+}
+
+PreviewDemand::~PreviewDemand()
+{
+	uint64_t value = 1;
+	if (write(stop_fd_, &value, sizeof(value)) < 0)
+		LOG_ERROR("Failed to stop preview watch thread");
+	watch_thread_.join();
+
+	close(stop_fd_);
+	close(inotify_fd_);
+}
+
+std::chrono::steady_clock::duration PreviewDemand::SinceLastRead() const
+{
+	return std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(last_read_);
+}
+
+void PreviewDemand::watchThread()
+{
+	pollfd fds[2] = { { inotify_fd_, POLLIN, 0 }, { stop_fd_, POLLIN, 0 } };
+	alignas(inotify_event) char buffer[4096];
+
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("Polling preview watch failed: " << errno);
+			return;
+		}
+
+		if (fds[1].revents & POLLIN)
+			return;
+
+		ssize_t len;
+		while ((len = read(inotify_fd_, buffer, sizeof(buffer))) > 0)
+		{
+			for (char *p = buffer; p < buffer + len;)
+			{
+				inotify_event const *event = reinterpret_cast<inotify_event const *>(p);
+				if (event->len && name_ == event->name)
+					last_read_ = std::chrono::steady_clock::now().time_since_epoch().count();
+				p += sizeof(inotify_event) + event->len;
+			}
+		}
+	}
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preview_demand.hpp - notice when someone reads the preview file.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// Watches the directory holding the preview (the file itself is replaced on every update)
+// with inotify, and records when the preview file was last opened or read by anyone.
+class PreviewDemand
+{
+public:
+	PreviewDemand(std::string const &preview_path);
+	~PreviewDemand();
+
+	// Time since the preview was last read. Starts counting from construction.
+	std::chrono::steady_clock::duration SinceLastRead() const;
+
+private:
+	void watchThread();
+
+	std::string name_;
+	int inotify_fd_;
+	int stop_fd_;
+	std::atomic<std::chrono::steady_clock::rep> last_read_;
+	std::thread watch_thread_;
+};
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preview_writer.cpp - encode and publish preview JPEGs off the event loop.
+ */
+
+#include <cstdio>
+
+#include "core/logging.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/still_options.hpp"
+#include "image/image.hpp"
+
+#include "preview_writer.hpp"
+
+PreviewWriter::PreviewWriter(RPiCamApp *app) : app_(app)
+{
+	thread_ = std::thread(&PreviewWriter::encodeThread, this);
+}
+
+PreviewWriter::~PreviewWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	thread_.join();
+
+	LOG(2, "Preview frames published: " << published_ << ", dropped: " << dropped_);
+}
+
+void PreviewWriter::Submit(CompletedRequestPtr const &completed_request, libcamera::Stream *stream,
+						   StillOptions const *options, unsigned int width, unsigned int height,
+						   std::shared_ptr<FrameRotator> const &rotator)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (pending_)
+		dropped_++;
+	pending_ = Item { completed_request, stream, options, width, height, rotator };
+	cond_var_.notify_one();
+}
+
+void PreviewWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_cond_var_.wait(lock, [this] { return !pending_ && !busy_; });
+}
+
+void PreviewWriter::encodeThread()
+{
+	while (true)
+	{
+		std::optional<Item> item;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			busy_ = false;
+			idle_cond_var_.notify_all();
+			cond_var_.wait(lock, [this] { return abort_ || pending_; });
+			if (abort_)
+			{
+				// Nothing should be waiting on us by now, but don't leave anyone hanging.
+				pending_.reset();
+				idle_cond_var_.notify_all();
+				return;
+			}
+			item = std::move(pending_);
+			pending_.reset();
+			busy_ = true;
+		}
+
+		try
+		{
+			auto start = std::chrono::steady_clock::now();
+			write(*item);
+			encode_time_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+								   std::chrono::steady_clock::now() - start).count();
+			published_++;
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Failed to write preview: " << e.what());
+		}
+		// Dropping the item here hands the buffer back to the camera.
+	}
+}
+
+void PreviewWriter::write(Item const &item)
+{
+	StreamInfo info = app_->GetStreamInfo(item.stream);
+	BufferReadSync r(app_, item.completed_request->buffers[item.stream]);
+	std::vector<libcamera::Span<uint8_t>> mem = r.Get();
+
+	FrameRotator::FramePtr rotated;
+	if (item.rotator)
+	{
+		rotated = item.rotator->Rotate(mem, info);
+		mem = rotated->mem;
+		info = rotated->info;
+	}
+
+	std::string const &filename = item.options->output;
+	std::string const tmp_filename = filename + ".part";
+
+	jpeg_save(mem, info, item.completed_request->metadata, tmp_filename, app_->CameraModel(), item.options, item.width,
+			  item.height);
+
+	// rename() replaces the old preview atomically.
+	if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("failed to rename " + tmp_filename + " to " + filename);
+}
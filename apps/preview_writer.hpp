@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * preview_writer.hpp - encode and publish preview JPEGs off the event loop.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "core/completed_request.hpp"
+
+#include "frame_rotator.hpp"
+
+class RPiCamApp;
+struct StillOptions;
+
+namespace libcamera
+{
+class Stream;
+}
+
+// Encodes preview frames in its own thread. Only the newest frame is ever encoded: a frame
+// that is still waiting when the next one is submitted is dropped (and its buffer returned
+// to the camera). Files are written next to the output and renamed into place, so readers
+// never see a partly written JPEG.
+class PreviewWriter
+{
+public:
+	PreviewWriter(RPiCamApp *app);
+	~PreviewWriter();
+
+	// The completed request is held until the frame has been encoded. The options must
+	// not change until the frame is written, see Flush(). Any rotation is done in our thread.
+	void Submit(CompletedRequestPtr const &completed_request, libcamera::Stream *stream, StillOptions const *options,
+				unsigned int width, unsigned int height, std::shared_ptr<FrameRotator> const &rotator = nullptr);
+	// Wait until everything submitted so far has been written. Must be called before the
+	// camera buffers are freed, or before changing the options.
+	void Flush();
+
+	uint64_t Published() const { return published_; }
+	uint64_t Dropped() const { return dropped_; }
+	// Mean time taken to encode and write a preview.
+	std::chrono::microseconds AverageEncodeTime() const
+	{
+		return std::chrono::microseconds(published_ ? encode_time_us_ / published_ : 0);
+	}
+
+private:
+	struct Item
+	{
+		CompletedRequestPtr completed_request;
+		libcamera::Stream *stream;
+		StillOptions const *options;
+		unsigned int width;
+		unsigned int height;
+		std::shared_ptr<FrameRotator> rotator;
+	};
+
+	void encodeThread();
+	void write(Item const &item);
+
+	RPiCamApp *app_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::condition_variable idle_cond_var_;
+	std::optional<Item> pending_;
+	bool busy_ = false;
+	bool abort_ = false;
+	std::atomic<uint64_t> published_ { 0 };
+	std::atomic<uint64_t> dropped_ { 0 };
+	std::atomic<uint64_t> encode_time_us_ { 0 };
+	std::thread thread_;
+};
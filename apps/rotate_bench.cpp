@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * rotate_bench.cpp - check the frame rotation against a plain per-pixel loop, and time the two.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "frame_rotator.hpp"
+
+// Straight from the definition, what the rotator has to match and beat. Clockwise, by 90, 180 or 270.
+static void rotate_naive(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+						 uint8_t *dst, unsigned int dst_stride, int rotation = 90)
+{
+	for (unsigned int y = 0; y < height; y++)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			size_t offset = rotation == 90	  ? x * dst_stride + (height - 1 - y)
+							: rotation == 180 ? (height - 1 - y) * dst_stride + (width - 1 - x)
+											  : (width - 1 - x) * dst_stride + y;
+			dst[offset] = src[y * src_stride + x];
+		}
+	}
+}
+
+static void rotate_naive(std::vector<uint8_t> const &src, StreamInfo const &info, std::vector<uint8_t> &dst,
+						 StreamInfo const &rotated, int rotation)
+{
+	uint8_t const *U = src.data() + info.stride * info.height;
+	uint8_t *dst_U = dst.data() + rotated.stride * rotated.height;
+	size_t uv_size = (info.stride / 2) * (info.height / 2);
+	size_t dst_uv_size = (rotated.stride / 2) * (rotated.height / 2);
+	rotate_naive(src.data(), info.stride, info.width, info.height, dst.data(), rotated.stride, rotation);
+	rotate_naive(U, info.stride / 2, info.width / 2, info.height / 2, dst_U, rotated.stride / 2, rotation);
+	rotate_naive(U + uv_size, info.stride / 2, info.width / 2, info.height / 2, dst_U + dst_uv_size,
+				 rotated.stride / 2, rotation);
+}
+
+// Compare the pixels of each plane, but not the padding at the end of the rows.
+static void compare(std::string const &what, uint8_t const *mem, std::vector<uint8_t> const &expected,
+					StreamInfo const &info)
+{
+	struct Plane
+	{
+		char const *name;
+		size_t offset;
+		unsigned int width, height, stride;
+	} planes[] = {
+		{ "Y", 0, info.width, info.height, info.stride },
+		{ "U", info.stride * info.height, info.width / 2, info.height / 2, info.stride / 2 },
+		{ "V", info.stride * info.height + (info.stride / 2) * (info.height / 2), info.width / 2, info.height / 2,
+		  info.stride / 2 },
+	};
+	for (auto const &plane : planes)
+	{
+		for (unsigned int y = 0; y < plane.height; y++)
+		{
+			uint8_t const *row = mem + plane.offset + y * plane.stride;
+			uint8_t const *want = expected.data() + plane.offset + y * plane.stride;
+			if (memcmp(row, want, plane.width) == 0)
+				continue;
+			unsigned int x = 0;
+			while (row[x] == want[x])
+				x++;
+			throw std::runtime_error(what + ": " + plane.name + " plane differs at " + std::to_string(x) + "," +
+									 std::to_string(y) + ", " + std::to_string(row[x]) + " instead of " +
+									 std::to_string(want[x]));
+		}
+	}
+}
+
+// The rotator only does quarter turns, so 180 is two of them one after the other.
+static void check(unsigned int width, unsigned int height)
+{
+	StreamInfo info;
+	info.width = width;
+	info.height = height;
+	info.stride = (width + 63) & ~63;
+	info.pixel_format = libcamera::formats::YUV420;
+	std::vector<uint8_t> src(info.stride * info.height * 3 / 2);
+	for (auto &pixel : src)
+		pixel = std::rand();
+	std::vector<libcamera::Span<uint8_t>> mem = { { src.data(), src.size() } };
+	std::string size = std::to_string(width) + "x" + std::to_string(height);
+
+	for (int rotation : { 90, 270 })
+	{
+		StreamInfo rotated = FrameRotator::Rotated(info);
+		std::vector<uint8_t> expected(rotated.stride * rotated.height * 3 / 2);
+		rotate_naive(src, info, expected, rotated, rotation);
+		FrameRotator rotator(rotation);
+		compare(size + " by " + std::to_string(rotation), rotator.Rotate(mem, info)->mem[0].data(), expected,
+				rotated);
+	}
+
+	std::vector<uint8_t> expected(src.size());
+	rotate_naive(src, info, expected, info, 180);
+	FrameRotator rotator(90);
+	auto once = rotator.Rotate(mem, info);
+	auto twice = rotator.Rotate(once->mem, once->info);
+	compare(size + " by 180", twice->mem[0].data(), expected, twice->info);
+}
+
+static void report(std::string const &what, unsigned int frames, std::function<void()> const &rotate)
+{
+	// Once to warm the caches (and fill the pool).
+	rotate();
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < frames; i++)
+		rotate();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+	std::cout << what << ": " << ms << "ms per frame, " << 1000 / ms << " fps" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	RPiCamApp::verbosity = 1;
+
+	// Sizes with partial blocks and partial tiles in the luma and chroma planes, as well as the usual ones.
+	try
+	{
+		for (auto [width, height] : { std::pair(1920u, 1080u), std::pair(1918u, 1082u), std::pair(642u, 482u),
+									  std::pair(70u, 38u), std::pair(18u, 10u), std::pair(2u, 2u) })
+			check(width, height);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	std::cout << "FrameRotator matches the per-pixel rotation" << std::endl;
+
+	StreamInfo info;
+	info.width = argc > 1 ? std::atoi(argv[1]) : 1920;
+	info.height = argc > 2 ? std::atoi(argv[2]) : 1080;
+	info.stride = (info.width + 63) & ~63;
+	info.pixel_format = libcamera::formats::YUV420;
+	unsigned int frames = argc > 3 ? std::atoi(argv[3]) : 100;
+
+	std::vector<uint8_t> src(info.stride * info.height * 3 / 2);
+	for (size_t i = 0; i < src.size(); i++)
+		src[i] = i * 7;
+	std::vector<libcamera::Span<uint8_t>> mem = { { src.data(), src.size() } };
+
+	StreamInfo rotated = FrameRotator::Rotated(info);
+	std::vector<uint8_t> dst(rotated.stride * rotated.height * 3 / 2);
+
+	std::cout << "Rotating " << info.width << "x" << info.height << " YUV420 frames" << std::endl;
+	report("Per-pixel", frames, [&]() { rotate_naive(src, info, dst, rotated, 90); });
+
+	FrameRotator rotator(90);
+	report("FrameRotator", frames, [&]() { rotator.Rotate(mem, info); });
+
+	return 0;
+}
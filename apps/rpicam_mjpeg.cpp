@@ -7,6 +7,7 @@
 */
 #include <cassert>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <ctime>
 #include <iomanip>
@@ -17,6 +18,9 @@
 #include <regex>
 #include <filesystem>
 #include <fstream>
+#include <algorithm>
+#include <array>
+#include <deque>
 
 //for mapping fifo
 #include <map>
@@ -45,7 +49,41 @@
 //check camera resolution
 #include "cameraResolutionChecker.hpp"
 
+// FIFO commands
+#include "command_fifo.hpp"
+#include "control_socket.hpp"
+
+// rotation
+#include "frame_rotator.hpp"
+
+// per-consumer threads
+#include "frame_worker.hpp"
+
+// preview
+#include "frame_pacer.hpp"
+#include "preview_demand.hpp"
+#include "preview_writer.hpp"
+
+// stills
+#include "still_writer.hpp"
+
+// timelapse
+#include "timelapse_video.hpp"
+
+// video
+#include "preroll_buffer.hpp"
+
+// media counters
+#include "media_index.hpp"
+
+// macros
+#include "hook_runner.hpp"
+
+// status
+#include "status_block.hpp"
+
 // motion detection
+#include "motion_trigger.hpp"
 #include "post_processing_stages/motion_detect_stage.cpp"
 
 using namespace std::placeholders;
@@ -71,6 +109,7 @@ public:
 		commands["pv"] = std::bind(&RPiCamMjpegApp::pv_handle, this, std::placeholders::_1);
 		commands["ro"] = std::bind(&RPiCamMjpegApp::ro_handle, this, std::placeholders::_1);
 		commands["fl"] = std::bind(&RPiCamMjpegApp::fl_handle, this, std::placeholders::_1);
+		commands["ri"] = std::bind(&RPiCamMjpegApp::ri_handle, this, std::placeholders::_1);
 		commands["sc"] = std::bind(&RPiCamMjpegApp::set_counts, this);
 		commands["md"] = std::bind(&RPiCamMjpegApp::md_handle, this, std::placeholders::_1);
 		commands["wb"] = std::bind(&RPiCamMjpegApp::wb_handle, this, std::placeholders::_1);
@@ -85,30 +124,71 @@ public:
 		commands["qu"] = std::bind(&RPiCamMjpegApp::qu_handle, this, std::placeholders::_1);
 		commands["bi"] = std::bind(&RPiCamMjpegApp::bi_handle, this, std::placeholders::_1);
 		commands["sh"] = std::bind(&RPiCamMjpegApp::sh_handle, this, std::placeholders::_1);
+		commands["ss"] = std::bind(&RPiCamMjpegApp::ss_handle, this, std::placeholders::_1);
+		commands["tl"] = std::bind(&RPiCamMjpegApp::tl_handle, this, std::placeholders::_1);
+		commands["tv"] = std::bind(&RPiCamMjpegApp::tv_handle, this, std::placeholders::_1);
+		commands["sy"] = std::bind(&RPiCamMjpegApp::sy_handle, this, std::placeholders::_1);
 
 	}
 
-	~RPiCamMjpegApp() { cleanup(); }
+	~RPiCamMjpegApp()
+	{
+		// No more commands once we start tearing down, and no more frames.
+		controlSocket.reset();
+		videoWorker.reset();
+		motionWorker.reset();
+		// Finish writing any stills and thumbnails while the media indexes are still around.
+		stillWriter.reset();
+		lapse_stop();
+		lapseWriter.reset();
+		cleanup();
+		// The pre-roll encoder outlives recordings, and mustn't outlive the pre-roll buffer.
+		h264Encoder.reset();
+		thumbnailWriter.reset();
+		// Last, the writers may still have been starting macros.
+		hookRunner.reset();
+	}
 
 	MjpegOptions *GetOptions() const { return static_cast<MjpegOptions *>(options_.get()); }
 
 	// Declare Encoder and FileOutput as member variables
 	std::unique_ptr<Encoder> h264Encoder;
 	std::unique_ptr<FileOutput> h264FileOutput;
+	// Ready and waiting for the next recording.
+	std::unique_ptr<Encoder> warmEncoder;
+	StreamInfo warmEncoderInfo;
+	// With a pre-roll the encoder never stops, and this sits between it and the recording.
+	std::unique_ptr<PrerollBuffer> preroll;
 	std::unique_ptr<MotionDetectStage> motionDetectStage;
+	std::unique_ptr<MotionTrigger> motionTrigger;
+	std::unique_ptr<PreviewWriter> previewWriter;
+	std::unique_ptr<StillWriter> stillWriter;
+	std::unique_ptr<StillWriter> thumbnailWriter;
+	std::unique_ptr<StillWriter> lapseWriter;
+	std::unique_ptr<TimelapseVideo> lapseVideo;
+	// Quarter turns the ISP can't do, only changed when the camera restarts.
+	std::shared_ptr<FrameRotator> rotator;
+	int software_rotation = 0;
+	FramePacer previewPacer;
+	std::unique_ptr<PreviewDemand> previewDemand;
+	bool preview_idle = false;
+	uint64_t preview_idle_skipped = 0;
 
 	bool preview_active;
 	bool still_active;
 	bool video_active;
 	bool motion_active;
+	bool lapse_active = false;
 	bool firstTime = true; 	// helper var for motion detect
 	// TODO: Remove this variable altogether... eventually
 	bool multi_active;
-	bool fifo_active() const { return !GetOptions()->fifo.empty(); }
+	bool fifo_active() const { return !GetOptions()->fifo.empty() || !GetOptions()->control_socket.empty(); }
 	std::optional<std::string> error = std::nullopt;
 
 	int image_count = 0; // still and timelapse
 	int video_count = 0;
+	int lapse_count = 0; // frames in the current timelapse
+	int lapse_image = 0; // the image number the current timelapse was given
 
 	// Get the application "status": https://github.com/roberttidey/userland/blob/e2b8cd0c80902d6aeb4f157c3cf1b1f61446b061/host_applications/linux/apps/raspicam/README_RaspiMJPEG.md
 	std::string status()
@@ -125,6 +205,8 @@ public:
 			return "md_video"; // motion detection and video recording
 		if (video_active)
 			return "video"; // recording
+		if (lapse_active)
+			return motion_active ? "tl_md_ready" : "timelapse"; // timelapse, maybe with motion detection
 		if (motion_active)
 			return "md_ready"; // motion detection
 		if (preview_active)
@@ -132,19 +214,107 @@ public:
 		return "halted"; // nothing
 	}
 
-	// Report the application status to --status-output file.
+	// Report the application status to --status-output file, and the status block.
 	void write_status()
 	{
+		std::string current = status();
+		publish_status(current);
+
+		// The web interface polls the file, but it rarely changes.
 		std::string status_output = GetOptions()->status_output;
-		if (status_output.empty())
+		if (status_output.empty() || current == last_status)
+			return;
+		last_status = current;
+
+		// Renamed into place, so it is never seen empty.
+		std::string tmp_output = status_output + ".part";
+		{
+			std::ofstream stream(tmp_output);
+			stream << current;
+		}
+		if (std::rename(tmp_output.c_str(), status_output.c_str()) != 0)
+			LOG_ERROR("Failed to write status to " << status_output);
+	}
+
+	std::string last_status;
+	std::unique_ptr<StatusBlock> statusBlock;
+	bool status_block_failed = false;
+	uint64_t frames = 0;
+	unsigned int restarts = 0;
+	// For the frame rate.
+	uint64_t fps_frames = 0;
+	std::chrono::steady_clock::time_point fps_start = std::chrono::steady_clock::now();
+	float fps = 0;
+
+	// Called with every completed request.
+	void count_frame()
+	{
+		frames++;
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<float> elapsed = now - fps_start;
+		if (elapsed < std::chrono::seconds(1))
+			return;
+		fps = (frames - fps_frames) / elapsed.count();
+		fps_frames = frames;
+		fps_start = now;
+	}
+
+	// Cheap enough to do on every trip round the event loop: a memcpy, plus a moment under each
+	// writer's and the hook runner's lock to read their queue depths.
+	void publish_status(std::string const &current)
+	{
+		MjpegOptions const *options = GetOptions();
+		if (options->status_block.empty() || status_block_failed)
 			return;
-		std::ofstream stream(status_output);
-		stream << status();
+		if (!statusBlock)
+		{
+			try
+			{
+				statusBlock = std::make_unique<StatusBlock>(options->status_block);
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("Cannot share the status: " << e.what());
+				status_block_failed = true;
+				return;
+			}
+		}
+
+		StatusData data = {};
+		// The error is given separately.
+		snprintf(data.state, sizeof(data.state), "%s", error ? "error" : current.c_str());
+		if (error)
+			snprintf(data.error, sizeof(data.error), "%s", error->c_str());
+		data.updated_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+							  std::chrono::system_clock::now().time_since_epoch()).count();
+		data.frames = frames;
+		data.fps = fps;
+		data.restarts = restarts;
+		data.image_count = image_count;
+		data.video_count = video_count;
+		data.lapse_count = lapse_count;
+		data.still_queue = stillWriter ? stillWriter->Pending() : 0;
+		data.thumbnail_queue = thumbnailWriter ? thumbnailWriter->Pending() : 0;
+		data.lapse_queue = lapseWriter ? lapseWriter->Pending() : 0;
+		if (hookRunner)
+		{
+			data.macro_queue = hookRunner->Queued();
+			data.macros_dropped = hookRunner->Dropped();
+			data.macros_timed_out = hookRunner->TimedOut();
+		}
+		if (previewWriter)
+		{
+			data.previews_published = previewWriter->Published();
+			data.previews_dropped = previewWriter->Dropped();
+		}
+		statusBlock->Publish(data);
 	}
 
 
 	void Configure(MjpegOptions *options)
 	{
+		// The frame kept back for zero shutter lag stills gets a buffer of its own.
+		SetHeldRequests(options->stillOptions.output.empty() ? 0 : 1);
 		if (multi_active)
 		{
 			// Call the multi-stream configuration function
@@ -163,8 +333,37 @@ public:
 	// Function to initialize the encoder and file output
 	void initialize_encoder(VideoOptions &videoOptions, const StreamInfo &info)
 	{
+		if (!h264Encoder)
+			create_encoder(videoOptions, info);
+		if (!h264Encoder)
+			return;
+
+		if (!h264FileOutput)
+		{
+			LOG(1, "Initializing FileOutput...");
+			h264FileOutput = std::make_unique<FileOutput>(&videoOptions); // Pass the VideoOptions object
+			// Write out the pre-roll, the live frames follow on from it.
+			if (preroll)
+				preroll->Start(h264FileOutput.get());
+		}
+	}
+
+	void create_encoder(VideoOptions &videoOptions, const StreamInfo &info)
+	{
+		if (warmEncoder && same_geometry(warmEncoderInfo, info) && warmEncoder->Retarget(videoOptions.output))
+		{
+			LOG(2, "Using warm encoder");
+			h264Encoder = std::move(warmEncoder);
+		}
+		warmEncoder.reset();
+
 		if (!h264Encoder)
 		{
+			// Whatever the last encoder didn't hand back is no use now.
+			{
+				std::lock_guard<std::mutex> lock(encoding_mutex);
+				encoding_frames.clear();
+			}
 			LOG(1, "Initializing encoder...");
 			h264Encoder = std::unique_ptr<Encoder>(
 				Encoder::Create(&videoOptions, info)); // Properly wrap the raw pointer into unique_ptr
@@ -175,25 +374,223 @@ public:
 			}
 		}
 
-		if (!h264FileOutput)
-		{
-			LOG(1, "Initializing FileOutput...");
-			h264FileOutput = std::make_unique<FileOutput>(&videoOptions); // Pass the VideoOptions object
-		}
-
-		// Set encoder callbacks (if not already set)
-		h264Encoder->SetInputDoneCallback([](void *buffer) { 
-            // LOG(1, "Input buffer done."); 
-        });
+		// Set encoder callbacks
+		// Encoders that never drop frames are done with them in the order they were given, and
+		// don't say which.
+		h264Encoder->SetInputDoneCallback([this](void *mem) {
+			std::lock_guard<std::mutex> lock(encoding_mutex);
+			auto it = encoding_frames.begin();
+			if (mem)
+				it = std::find_if(encoding_frames.begin(), encoding_frames.end(),
+								  [mem](FrameRotator::FramePtr const &frame) { return frame->mem[0].data() == mem; });
+			if (it != encoding_frames.end())
+				encoding_frames.erase(it);
+		});
 
 		h264Encoder->SetOutputReadyCallback(
 			[this](void *data, size_t size, int64_t timestamp, bool keyframe)
 			{
-				LOG(1, "Output ready: size = " << size << ", timestamp = " << timestamp);
-				h264FileOutput->OutputReady(data, size, timestamp, keyframe);
+				LOG_RATE_LIMITED(2, 1000, "Output ready: size = " << size << ", timestamp = " << timestamp);
+				if (preroll)
+					preroll->OutputReady(data, size, timestamp, keyframe);
+				else
+					h264FileOutput->OutputReady(data, size, timestamp, keyframe);
 			});
 	}
 
+	bool preroll_wanted() const
+	{
+		MjpegOptions const *options = GetOptions();
+		return options->video_buffer && !options->video_output.empty();
+	}
+
+	// RaspiMJPEG's video_buffer: keep the encoder running all the time, so recordings can start
+	// with what happened just before they were asked for.
+	void start_preroll()
+	{
+		MjpegOptions *options = GetOptions();
+		if (!preroll_wanted() || h264Encoder || !VideoStream())
+			return;
+
+		if (!preroll)
+		{
+			// Room for the pre-roll plus a GOP or two at the configured bitrate, with some to spare.
+			uint64_t bps = std::max<uint64_t>(options->videoOptions.bitrate.bps(), 10000000);
+			size_t capacity = bps / 8 * (options->video_buffer + 2000) / 1000 * 2;
+			preroll = std::make_unique<PrerollBuffer>(std::chrono::milliseconds(options->video_buffer), capacity);
+		}
+
+		// No output file, the encoded frames all go to the pre-roll buffer.
+		options->videoOptions.output = "";
+		create_encoder(options->videoOptions, saved_info(VideoStream()));
+	}
+
+	// The stream may have changed under the pre-roll encoder.
+	void stop_preroll()
+	{
+		if (!preroll || h264FileOutput)
+			return;
+		flush_video();
+		h264Encoder.reset();
+		preroll->Clear();
+	}
+
+	// Keep the pre-roll encoder fed between recordings.
+	void preroll_save(const CompletedRequestPtr &completed_request)
+	{
+		if (!h264Encoder)
+			return;
+		video_submit(completed_request);
+	}
+
+	// Video frames are rotated (if need be) and handed to the encoder in their own thread. The
+	// encoder must not change while that has frames, see flush_video().
+	static constexpr size_t VIDEO_QUEUE_DEPTH = 4;
+	std::unique_ptr<FrameWorker> videoWorker;
+
+	void video_submit(const CompletedRequestPtr &completed_request)
+	{
+		if (!videoWorker)
+			videoWorker = std::make_unique<FrameWorker>(
+				"video", VIDEO_QUEUE_DEPTH, [this](CompletedRequestPtr &r) { video_encode(r); }, true);
+		videoWorker->Submit(completed_request);
+	}
+
+	void flush_video()
+	{
+		if (videoWorker)
+			videoWorker->Flush();
+	}
+
+	// Runs in the video worker.
+	void video_encode(CompletedRequestPtr &completed_request)
+	{
+		if (!h264Encoder)
+			return;
+
+		Stream *stream = VideoStream();
+		FrameRotator::FramePtr frame = saved_frame(completed_request, stream);
+		if (frame->mem.empty() || frame->mem[0].size() == 0)
+			throw std::runtime_error("buffer is empty");
+
+		auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+		int64_t timestamp_us = ts ? *ts / 1000 : completed_request->buffers[stream]->metadata().timestamp / 1000;
+		encode(frame, timestamp_us);
+	}
+
+	// Frames given to the video encoder, held until it has finished with them.
+	std::mutex encoding_mutex;
+	std::deque<FrameRotator::FramePtr> encoding_frames;
+
+	void encode(FrameRotator::FramePtr const &frame, int64_t timestamp_us)
+	{
+		{
+			std::lock_guard<std::mutex> lock(encoding_mutex);
+			encoding_frames.push_back(frame);
+		}
+		h264Encoder->EncodeBuffer(frame->fd, frame->mem[0].size(), frame->mem[0].data(), frame->info, timestamp_us);
+	}
+
+	// What frames from the stream look like once saved, after any rotation.
+	StreamInfo saved_info(Stream *stream) const
+	{
+		StreamInfo info = GetStreamInfo(stream);
+		return rotator ? FrameRotator::Rotated(info) : info;
+	}
+
+	// The frame as it is to be saved, rotated if the ISP couldn't do it. Unless rotated this is
+	// the camera buffer itself, so it holds on to the completed request until it's released.
+	FrameRotator::FramePtr saved_frame(CompletedRequestPtr const &completed_request, Stream *stream)
+	{
+		libcamera::FrameBuffer *buffer = completed_request->buffers[stream];
+		BufferReadSync r(this, buffer);
+		if (rotator)
+			return rotator->Rotate(r.Get(), GetStreamInfo(stream));
+		return FrameRotator::FramePtr(
+			new FrameRotator::Frame { buffer->planes()[0].fd.get(), r.Get(), GetStreamInfo(stream) },
+			[completed_request](FrameRotator::Frame *frame) { delete frame; });
+	}
+
+	// Pick up a change of rotation, while the camera is stopped.
+	void update_rotator()
+	{
+		if (!software_rotation)
+			rotator.reset();
+		else if (!rotator || rotator->Rotation() != software_rotation)
+			rotator = std::make_shared<FrameRotator>(software_rotation);
+	}
+
+	static bool same_geometry(StreamInfo const &a, StreamInfo const &b)
+	{
+		return a.width == b.width && a.height == b.height && a.stride == b.stride && a.pixel_format == b.pixel_format;
+	}
+
+	// Setting up an encoder can take hundreds of ms (libx264 especially), so have one ready
+	// before we are asked to record. Not needed while recording or keeping a pre-roll, as
+	// there's an encoder running already. Encoders can run side by side (every open of the
+	// V4L2 codec gets its own context), as they do when a timelapse is appended to alongside.
+	void prewarm_encoder()
+	{
+		MjpegOptions *options = GetOptions();
+		if (h264Encoder || preroll_wanted() || options->video_output.empty() || !VideoStream())
+			return;
+
+		StreamInfo info = saved_info(VideoStream());
+		if (warmEncoder && same_geometry(warmEncoderInfo, info))
+			return;
+		warmEncoder.reset();
+
+		auto start = std::chrono::steady_clock::now();
+		// Encoders writing their own output don't open it until the first frame, so this
+		// name is only a placeholder (with the right extension) to be retargeted later.
+		options->videoOptions.output = make_name(options->video_output);
+		try
+		{
+			warmEncoder = std::unique_ptr<Encoder>(Encoder::Create(&options->videoOptions, info));
+			warmEncoderInfo = info;
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Failed to warm up encoder, it will be created when recording starts: " << e.what());
+		}
+		options->videoOptions.output = "";
+
+		auto elapsed =
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		if (warmEncoder)
+			LOG(1, "Encoder warmed up in " << elapsed.count() << "ms");
+	}
+
+	// When `ca 1` arrived, so we know which frame to start on, and how long it took.
+	std::optional<std::chrono::steady_clock::time_point> video_requested;
+	unsigned int recordings_started = 0;
+	std::chrono::milliseconds total_start_latency { 0 };
+
+	// Frames exposed before the command was sent aren't part of the recording.
+	bool video_due(CompletedRequestPtr const &completed_request, Stream *stream) const
+	{
+		if (!video_requested)
+			return true;
+		int64_t requested =
+			std::chrono::duration_cast<std::chrono::nanoseconds>(video_requested->time_since_epoch()).count();
+		return (int64_t)frame_timestamp(completed_request, stream) >= requested;
+	}
+
+	void report_start_latency(bool warm)
+	{
+		if (!video_requested)
+			return;
+
+		auto latency =
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *video_requested);
+		video_requested.reset();
+		recordings_started++;
+		total_start_latency += latency;
+		LOG(1, "Recording started " << latency.count() << "ms after `ca 1` (" << (warm ? "warm" : "cold")
+									<< " encoder, average " << total_start_latency.count() / recordings_started
+									<< "ms over " << recordings_started << " recordings)");
+	}
+
 	void initialize_motion_detect_stage()
 	{
 		if (motionDetectStage != nullptr)
@@ -225,11 +622,152 @@ public:
 		motionDetectStage->Configure();
 	}
 
-	void cleanup_motion_detect_stage() { motionDetectStage.reset(); }
+	void cleanup_motion_detect_stage()
+	{
+		motionWorker.reset();
+		motionDetectStage.reset();
+		motion_results.clear();
+	}
+
+	// FIFO commands whose controls have been queued but not yet seen on a completed request.
+	std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> pending_controls;
+
+	// Hand controls to the next queued request; no need to stop the camera for these.
+	void apply_controls(const std::string &command, const libcamera::ControlList &controls)
+	{
+		SetControls(controls);
+		pending_controls.emplace_back(command, std::chrono::steady_clock::now());
+	}
+
+	// Report the command to first affected frame latency for any controls that just landed.
+	// NOTE: ISP controls take effect on this frame, sensor controls (exposure, gain) may
+	// take a couple more frames to show up in the image.
+	void report_controls_latency(CompletedRequestPtr &completed_request)
+	{
+		if (!completed_request->controls_applied || pending_controls.empty())
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		for (auto const &[command, time] : pending_controls)
+		{
+			auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(now - time).count();
+			LOG(1, "Command `" << command << "` applied at frame " << completed_request->sequence << " after " << latency
+							   << "ms");
+		}
+		pending_controls.clear();
+	}
+
+	// Only needed when the stream geometry changes, or the camera has stopped delivering frames.
+	void restart_camera()
+	{
+		restarts++;
+		blackout_start = std::chrono::steady_clock::now();
+		// The preview writer may still be reading a buffer we are about to free.
+		flush_preview();
+		flush_video();
+		// Set up again for the new lores stream.
+		cleanup_motion_detect_stage();
+		drop_held_frames();
+		// The timelapse carries on at the end of the same file after the restart.
+		lapseVideo.reset();
+		stop_preroll();
+		StopCamera();
+		Teardown();
+		update_rotator();
+		Configure(GetOptions());
+		// Anything pending is picked up from the options by StartCamera.
+		pending_controls.clear();
+		reset_crop();
+		previewPacer.Reset();
+		StartCamera();
+		// Only rebuilt if the video stream changed.
+		prewarm_encoder();
+		start_preroll();
+	}
+
+	// The web interface tends to send several reconfiguring commands (px, ro, fl, pv...) back to
+	// back, so rather than restarting for each one we wait until they stop arriving and restart once.
+	static constexpr std::chrono::milliseconds RECONFIGURE_DEBOUNCE { 150 };
+	// ...but don't let a steady trickle of commands put it off forever.
+	static constexpr std::chrono::milliseconds RECONFIGURE_MAX_DELAY { 1000 };
+
+	unsigned int reconfigure_requests = 0; // in the current burst
+	std::chrono::steady_clock::time_point reconfigure_first;
+	std::chrono::steady_clock::time_point reconfigure_last;
+	std::optional<std::chrono::steady_clock::time_point> blackout_start;
+	unsigned int burst_requests = 0; // of the burst whose restart is in progress
+	bool timeout_restart = false;
+
+	// Totals over the lifetime of the app.
+	unsigned int restarts_saved = 0;
+	std::chrono::milliseconds total_blackout { 0 };
+
+	void schedule_restart(const std::string &command)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (reconfigure_requests++ == 0)
+			reconfigure_first = now;
+		reconfigure_last = now;
+		LOG(2, "Command `" << command << "` needs a restart (" << reconfigure_requests << " pending)");
+	}
+
+	bool reconfigure_pending() const { return reconfigure_requests > 0; }
+
+	// How long until the pending reconfiguration is due.
+	std::chrono::milliseconds reconfigure_timeout() const
+	{
+		auto due = std::min(reconfigure_last + RECONFIGURE_DEBOUNCE, reconfigure_first + RECONFIGURE_MAX_DELAY);
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+		return std::max(remaining, std::chrono::milliseconds(0));
+	}
+
+	void reconfigure_if_due()
+	{
+		if (!reconfigure_pending() || reconfigure_timeout().count() > 0)
+			return;
+
+		burst_requests = reconfigure_requests;
+		restarts_saved += reconfigure_requests - 1;
+		reconfigure_requests = 0;
+		restart_camera();
+	}
+
+	// Any reconfiguration still waiting is picked up by the same restart.
+	void restart_after_timeout()
+	{
+		timeout_restart = true;
+		burst_requests = reconfigure_requests;
+		restarts_saved += reconfigure_requests;
+		reconfigure_requests = 0;
+		restart_camera();
+	}
+
+	// Report how long the camera was dark for once the first frame after a restart turns up.
+	void report_blackout()
+	{
+		if (!blackout_start)
+			return;
+
+		auto blackout =
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *blackout_start);
+		total_blackout += blackout;
+		blackout_start.reset();
+		std::string reason = timeout_restart ? "a device timeout" : std::to_string(burst_requests) + " command(s)";
+		timeout_restart = false;
+		LOG(1, "Restarted once for " << reason << ", blackout " << blackout.count()
+									 << "ms (total: " << restarts_saved << " restarts saved, " << total_blackout.count()
+									 << "ms blackout)");
+	}
 
 	void cleanup()
 	{
-		if (h264Encoder)
+		// Everything recorded so far goes in the file.
+		flush_video();
+		video_requested.reset();
+		// The pre-roll encoder keeps going, only the recording stops.
+		if (preroll)
+			preroll->Stop();
+		else if (h264Encoder)
 		{
 			LOG(1, "Cleaning up encoder...");
 			h264Encoder.reset(); // This will call the destructor of the encoder and release its resources
@@ -240,45 +778,63 @@ public:
 			LOG(1, "Cleaning up file output...");
 			h264FileOutput.reset(); // Free the file output resources
 			auto options = GetOptions();
+			// The file is complete now, we have no separate boxing step.
+			run_macro(options->end_vid, { options->videoOptions.output });
+			run_macro(options->end_box, { options->videoOptions.output });
 			// NOTE: videoOptions.output contains the generate file name (make_name).
-			thumbnail_save(options->videoOptions.output, 'v');
+			index_media(options->videoOptions.output, [this](MediaIndex &index) {
+				index.AddMedia('v', video_count);
+				index.Stamp();
+			});
+			if (video_thumbnail)
+				thumbnail_save(std::move(*video_thumbnail));
+			video_thumbnail.reset();
 			options->videoOptions.output = "";
 			video_count++;
 		}
 	}
 
 
-	// FIXME: This name is terrible!
-	// TODO: It'd be nice to integrate this will app.Wait(), but that probably requires a decent refactor *~*
-	std::string get_fifo_command()
+	// Commands from the FIFO arrive through Wait() as MsgType::Command, so they get
+	// handled straight away rather than once per frame.
+	std::unique_ptr<CommandFifo> commandFifo;
+
+	void start_command_fifo()
 	{
-		static std::string fifo_path = GetOptions()->fifo;
-		static int fd = -1;
+		if (!fifo_active() || commandFifo || controlSocket)
+			return;
 
-		if (fifo_path == "")
-			return "";
+		if (!GetOptions()->fifo.empty())
+			commandFifo = std::make_unique<CommandFifo>(GetOptions()->fifo, [this](std::string const &command) {
+				MsgType type = MsgType::Command;
+				MsgPayload payload = command;
+				PostMessage(type, payload);
+			});
+		if (!GetOptions()->control_socket.empty())
+			controlSocket = std::make_unique<ControlSocket>(
+				GetOptions()->control_socket, [this](uint64_t id, std::vector<std::string> commands) {
+					MsgType type = MsgType::Command;
+					MsgPayload payload = CommandBatch { id, std::move(commands) };
+					PostMessage(type, payload);
+				});
+	}
 
-		// NOTE: On the first read the FIFO will be blocking if we using normal
-		// C++ I/O (ifstream); so instead we create the FD ourselves so we can set
-		// the O_NONBLOCK flag :)
-		if (fd == -1) {
-			fd = open(fifo_path.c_str(), O_RDONLY | O_NONBLOCK);
-			if (fd < 0) throw std::system_error(errno, std::generic_category(), fifo_path);
-		}
+	// Batches from the control socket are acknowledged with the first frame to come out after
+	// they have been handled, so a client knows which frames show its changes.
+	std::unique_ptr<ControlSocket> controlSocket;
+	std::vector<uint64_t> pending_acks;
 
-		// FIXED: buffered reader minimizes number of function calls to read
-		std::string command = "";
-		char buffer[32];
-		int bytes_read;
-		while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-			if (buffer[bytes_read - 1] == '\n') {
-				command.append(buffer, bytes_read - 1);
-				break;
-			}
-			command.append(buffer, bytes_read);
-		}
+	void acknowledge(CompletedRequestPtr &completed_request)
+	{
+		if (pending_acks.empty())
+			return;
+		// Still waiting for a restart, or for controls to reach a request.
+		if (reconfigure_pending() || blackout_start || !pending_controls.empty() || crop_moving())
+			return;
 
-		return command;
+		for (uint64_t id : pending_acks)
+			controlSocket->Reply(id, "OK " + std::to_string(completed_request->sequence) + "\n");
+		pending_acks.clear();
 	}
 
 	void ro_handle(std::vector<std::string> args)
@@ -291,25 +847,21 @@ public:
 		// Default (no arguments) is 0 degrees.
 		int rotation = args.size() == 0 ? 0 : std::stoi(args[0]) % 360;
 
-		if (rotation != 0 && rotation != 180)
-		{
-			// https://github.com/raspberrypi/rpicam-apps/issues/505
-			throw std::runtime_error("transforms requiring transpose not supported");
-		}
+		// The ISP can't transpose (https://github.com/raspberrypi/rpicam-apps/issues/505), so
+		// quarter turns are done by the FrameRotator once the camera restarts.
+		bool transpose = rotation == 90 || rotation == 270;
 
 		bool ok;
-		Transform rot = transformFromRotation(rotation, &ok);
+		Transform rot = transformFromRotation(transpose ? 0 : rotation, &ok);
 		if (!ok)
 			throw std::runtime_error("unsupported rotation value: " + args[0]);
 
 		auto options = GetOptions();
 		options->SetRotation(rot);
+		software_rotation = transpose ? rotation : 0;
 
-		// FIXME: Can we avoid resetting everything?
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		// The transform is part of the camera configuration.
+		schedule_restart("ro");
 	}
 
 	void fl_handle(std::vector<std::string> args)
@@ -333,14 +885,99 @@ public:
 			flip = Transform::VFlip * flip;
 		options->SetFlip(flip);
 
-		// FIXME: Can we avoid resetting everything?
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		// The transform is part of the camera configuration.
+		schedule_restart("fl");
+	}
+
+	// Digital pan/zoom. Changing the ScalerCrop needs no restart, and when asked to take a number
+	// of frames over it we move it a step each frame.
+	libcamera::Rectangle crop_from;
+	libcamera::Rectangle crop_to;
+	libcamera::Rectangle crop_current;
+	unsigned int crop_frame = 0;
+	unsigned int crop_frames = 0;
+
+	bool crop_moving() const { return crop_frame < crop_frames; }
+
+	// The ScalerCrop for a region of the sensor (in fractions), worked out the same way as StartCamera.
+	libcamera::Rectangle region_crop(float x, float y, float width, float height) const
+	{
+		auto const &info = GetCameraControls().at(&libcamera::controls::ScalerCrop);
+		if (width == 0 || height == 0)
+			return info.def().get<libcamera::Rectangle>();
+
+		libcamera::Rectangle sensor_area = info.max().get<libcamera::Rectangle>();
+		libcamera::Rectangle crop(x * sensor_area.width, y * sensor_area.height, width * sensor_area.width,
+								  height * sensor_area.height);
+		crop.translateBy(sensor_area.topLeft());
+		return crop;
+	}
+
+	libcamera::Rectangle region_crop() const
+	{
+		MjpegOptions const *options = GetOptions();
+		return region_crop(options->roi_x, options->roi_y, options->roi_width, options->roi_height);
+	}
+
+	void ri_handle(std::vector<std::string> args)
+	{
+		if (args.size() != 4 && args.size() != 5)
+			throw std::runtime_error("expected 4 or 5 arguments to `ri` command");
+
+		// Start from wherever we are, which may be part way through another move.
+		libcamera::Rectangle from = crop_moving() ? crop_current : region_crop();
+		auto options = GetOptions();
+		options->SetRaspiMjpegRegion(std::stoul(args[0]), std::stoul(args[1]), std::stoul(args[2]),
+									 std::stoul(args[3]));
+
+		crop_from = from;
+		crop_to = region_crop();
+		crop_frame = 0;
+		crop_frames = args.size() == 5 ? std::stoul(args[4]) : 0;
+		if (!crop_moving())
+			set_crop(crop_to, true);
+	}
+
+	void set_crop(libcamera::Rectangle const &crop, bool last)
+	{
+		crop_current = crop;
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::ScalerCrop, crop);
+		// Report the latency (and acknowledge) on arriving, not on every step.
+		if (last)
+			apply_controls("ri", controls);
+		else
+			SetControls(controls);
+	}
+
+	// Called with every completed request, so the next step goes on the next request queued.
+	void update_crop()
+	{
+		if (!crop_moving())
+			return;
+
+		crop_frame++;
+		float t = (float)crop_frame / crop_frames;
+		// Ease in and out, so the move doesn't start or stop with a jolt.
+		t = t * t * (3 - 2 * t);
+		auto step = [t](int from, int to) { return (int)std::lround(from + (to - from) * t); };
+		libcamera::Rectangle crop(step(crop_from.x, crop_to.x), step(crop_from.y, crop_to.y),
+								  step(crop_from.width, crop_to.width), step(crop_from.height, crop_to.height));
+		set_crop(crop, !crop_moving());
+	}
+
+	// The sensor mode may have changed, so any move is cut short and the crop worked out again.
+	void reset_crop()
+	{
+		if (!crop_moving())
+			return;
+		crop_frames = 0;
+		set_crop(region_crop(), false);
 	}
 
 	void im_handle(){
+		// Remember when we were asked, the still is taken from the frame nearest to this.
+		still_requested = std::chrono::steady_clock::now();
 		still_active = true;
 	}
 
@@ -350,12 +987,20 @@ public:
 				if (video_active)  // finish up with the current recording.
 					cleanup();
 				video_active = false;
+				motion_recording = false;
+				// Get ready for the next one.
+				prewarm_encoder();
 
 			}
 		else
 		{
+			// The scheduler may echo our own motion recording back to us, that stays ours.
+			if (!video_active)
+				motion_recording = false;
 			video_active = true;
 			start_time = std::chrono::steady_clock::now();
+			if (!h264FileOutput)
+				video_requested = start_time;
 			if (args.size() >= 2) {
 				duration_limit_seconds = std::stoi(args[1]);
 			} else {
@@ -373,36 +1018,56 @@ public:
 			throw std::runtime_error("Expected at least three arguments to `pv` command");
 		
 
-		auto options = GetOptions();
-		options->previewOptions.quality = std::stoi(args[0]);
-		options->previewOptions.width = std::stoi(args[1]);
-		// TODO: Use the divider to set the frame rate somehow
+		int quality, width, divider;
+		try
+		{
+			quality = std::stoi(args[0]);
+			width = std::stoi(args[1]);
+			divider = std::stoi(args[2]);
+			if (quality <= 0 || width <= 0 || divider <= 0)
+				throw std::invalid_argument("Values must be positive.");
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << "Invalid argument: `pv` expects positive quality, width and divider." << std::endl;
+			return;
+		}
 
-		StopCamera();
-		Teardown();
-		Configure(options);
+		auto options = GetOptions();
+		// Don't change the options under a preview or thumbnail that is being encoded.
+		flush_preview();
+		if (thumbnailWriter)
+			thumbnailWriter->Flush();
+		options->previewOptions.quality = quality;
+		options->previewOptions.width = width;
+		options->frameDivider = divider;
+		update_preview_pacing();
+
+		// The preview is encoded from the viewfinder stream, so this only needs a
+		// restart if we don't have one yet.
 		preview_active = true;
-		StartCamera();
+		if (!ViewfinderStream())
+			schedule_restart("pv");
 	}
 
 	void md_handle(std::vector<std::string> args){
 		if (args.size() < 1 || args[0] != "1")
 		{ 
 			motion_active = false;
+			motion_record_stop();
 		}
 		else
 		{
 			motion_active = true;	
 			firstTime = true;
+			if (motionTrigger)
+				motionTrigger->Reset();
 			auto options = GetOptions();
 
 			// FIXME: dont use the motion_detect.json anymore? 
 			options->post_process_file = "assets/motion_detect.json";
 
-			StopCamera();
-			Teardown();
-			Configure(options);
-			StartCamera();
+			schedule_restart("md");
 		}
 	}
 
@@ -426,10 +1091,15 @@ public:
 			return;
 		}
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		if (options->awb_index == Options::AwbLookup("off"))
+			controls.set(libcamera::controls::AwbEnable, false);
+		else
+		{
+			controls.set(libcamera::controls::AwbEnable, true);
+			controls.set(libcamera::controls::AwbMode, options->awb_index);
+		}
+		apply_controls("wb", controls);
 	}
 	
 	void px_handle(std::vector<std::string> args)
@@ -438,13 +1108,25 @@ public:
 			throw std::runtime_error("Expected 7 arguments to `px` command: width height video_fps preview_fps image_width image_height frame_divider");
 
 		// Parse the arguments
-		int videoWidth = std::stoi(args[0]);     // Video width
-		int videoHeight = std::stoi(args[1]);    // Video height
-		int videoFps = std::stoi(args[2]);       // Video FPS
-		int previewFps = std::stoi(args[3]);     // Preview FPS
-		int imageWidth = std::stoi(args[4]);     // Image (still capture) width
-		int imageHeight = std::stoi(args[5]);    // Image (still capture) height
-		int frameDivider = std::stoi(args[6]);   // Frame divider
+		int videoWidth, videoHeight, videoFps, previewFps, imageWidth, imageHeight, frameDivider;
+		try
+		{
+			videoWidth = std::stoi(args[0]);     // Video width
+			videoHeight = std::stoi(args[1]);    // Video height
+			videoFps = std::stoi(args[2]);       // Video FPS
+			previewFps = std::stoi(args[3]);     // Preview FPS, 0 for no limit
+			imageWidth = std::stoi(args[4]);     // Image (still capture) width
+			imageHeight = std::stoi(args[5]);    // Image (still capture) height
+			frameDivider = std::stoi(args[6]);   // Frame divider
+			if (videoWidth <= 0 || videoHeight <= 0 || videoFps <= 0 || previewFps < 0 || imageWidth <= 0 ||
+				imageHeight <= 0 || frameDivider <= 0)
+				throw std::invalid_argument("Values out of range.");
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << "Invalid argument: `px` expects positive sizes, frame rates and divider." << std::endl;
+			return;
+		}
 
 		// Set the video and image resolution in the options
 		auto options = GetOptions();
@@ -452,7 +1134,9 @@ public:
 		options->videoOptions.height = videoHeight;
 		options->videoOptions.fps = videoFps;    // Set video FPS
 		
-		options->frameDivider = frameDivider;    // Optional: Handle this as needed
+		options->frameDivider = frameDivider;
+		options->preview_fps = previewFps;
+		update_preview_pacing();
 
 		// Log the parsed values for debugging
 		LOG(1, "px command received: video=" << videoWidth << "x" << videoHeight 
@@ -461,10 +1145,7 @@ public:
 			<< ", frame divider=" << frameDivider);
 
 		// Reconfigure the camera with the new resolution
-		StopCamera();    // Stop the camera
-		Teardown();      // Clean up the current configuration
-		Configure(options); // Apply the new configuration with the updated resolution
-		StartCamera();   // Restart the camera with the new settings
+		schedule_restart("px");
 	}
 
 	void mm_handle(std::vector<std::string> args){
@@ -483,10 +1164,9 @@ public:
 		options->previewOptions.metering_index = new_mm_index;
 		//options->videoOptions.Print();
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::AeMeteringMode, new_mm_index);
+		apply_controls("mm", controls);
 	}
   
 	void co_handle(std::vector<std::string> args)
@@ -497,14 +1177,12 @@ public:
 		float contrast = std::stof(args[0]);  // Use float for contrast
 
 		auto options = GetOptions();
-		options->contrast = contrast;
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
+		options->contrast = MjpegOptions::NormalizeRaspiMjpegScale(contrast);
 		LOG(1, "Contrast updated to: " << options->contrast);  // Log the updated contrast value
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::Contrast, options->contrast);
+		apply_controls("co", controls);
 	}
 
 	void br_handle(std::vector<std::string> args)
@@ -514,13 +1192,11 @@ public:
 
 		float brightness = std::stof(args[0]);  // Use float for brightness
 		auto options = GetOptions();
-		options->brightness = brightness;
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
+		options->brightness = MjpegOptions::NormalizeRaspiMjpegBrightness(brightness);
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::Brightness, options->brightness);
+		apply_controls("br", controls);
 	}
 
 
@@ -530,17 +1206,15 @@ public:
 		
 		auto options = GetOptions();
 		try{
-			options->ev = stof(args[0]);;
+			options->ev = MjpegOptions::NormalizeRaspiMjpegEv(stof(args[0]));
 		} catch (const std::invalid_argument &e) {
 			std::cerr << "Invalid argument: The provided value is not a valid number." << std::endl;
 			return;
 		} 
 
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::ExposureValue, options->ev);
+		apply_controls("ec", controls);
 	}
 
 	void ag_handle(std::vector<std::string> args){
@@ -548,10 +1222,11 @@ public:
 			throw std::runtime_error("Expected only two arguments for `ag` command");
 		
 		auto options = GetOptions();
+		float awb_gain_r, awb_gain_b;
 		try{
-			options->awb_gain_r = stof(args[0]);
-			options->awb_gain_b = stof(args[1]);
-			if (options->awb_gain_r < 0 || options->awb_gain_b < 0){
+			awb_gain_r = stof(args[0]);
+			awb_gain_b = stof(args[1]);
+			if (awb_gain_r < 0 || awb_gain_b < 0){
 				throw std::invalid_argument("Negative values are not allowed.");
 			}
 				
@@ -560,11 +1235,14 @@ public:
 			return;
 		} 
 
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		options->awb_gain_r = MjpegOptions::NormalizeRaspiMjpegAwbGain(awb_gain_r);
+		options->awb_gain_b = MjpegOptions::NormalizeRaspiMjpegAwbGain(awb_gain_b);
+		options->awbgains = std::to_string(options->awb_gain_r) + "," + std::to_string(options->awb_gain_b);
+
+		const std::array<float, 2> gains = { options->awb_gain_r, options->awb_gain_b };
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::ColourGains, libcamera::Span<const float, 2>(gains));
+		apply_controls("ag", controls);
 	}
 
 	void is_handle(std::vector<std::string> args){
@@ -573,17 +1251,15 @@ public:
 		
 		auto options = GetOptions();
 		try{
-			options->gain = stof(args[0]);
+			options->gain = MjpegOptions::NormalizeRaspiMjpegGain(stof(args[0]));
 		} catch (const std::invalid_argument &e) {
 			std::cerr << "Invalid argument: The provided value is not a valid number." << std::endl;
 			return;
 		}
 
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::AnalogueGain, options->gain);
+		apply_controls("is", controls);
 	}
 	
 	void sa_handle(std::vector<std::string> args)
@@ -592,13 +1268,11 @@ public:
 			throw std::runtime_error("expected at most 1 argument to `sa` command");
 
 		auto options = GetOptions();
-		options->saturation = std::stof(args[0]);  // Use float for contrast
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
+		options->saturation = MjpegOptions::NormalizeRaspiMjpegScale(std::stof(args[0]));
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::Saturation, options->saturation);
+		apply_controls("sa", controls);
 	}
 
 	void ss_handle(std::vector<std::string> args)
@@ -617,10 +1291,10 @@ public:
 
 		LOG(1, "Shutter speed updated to: " << shutter_speed << " microseconds");
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		// NOTE: An exposure time of 0 hands control back to the AGC.
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::ExposureTime, shutter_speed);
+		apply_controls("ss", controls);
 	}
 
 	void qu_handle(std::vector<std::string> args)
@@ -630,13 +1304,12 @@ public:
 	
 		float quality = std::stof(args[0]);  // Use float for quality
 
+		// The stills are encoded by us, so the next one simply picks this up. Let any
+		// stills still being written finish with the quality they were taken at.
+		if (stillWriter)
+			stillWriter->Flush();
 		auto options = GetOptions();
-		options->stillOptions.quality = quality;
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		options->stillOptions.quality = MjpegOptions::NormalizeRaspiMjpegQuality(quality);
 	}
 
 	void bi_handle(std::vector<std::string> args)
@@ -646,12 +1319,16 @@ public:
 	
 		auto options = GetOptions();
 		options->videoOptions.bitrate.set(args[0] + "bps"); // FIXME: This is really bad!
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
-	
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		uint64_t bitrate = MjpegOptions::NormalizeRaspiMjpegBitrate(options->videoOptions.bitrate.bps());
+		options->videoOptions.bitrate.set(std::to_string(bitrate) + "bps");
+
+		// Change a running recording in place, otherwise the next recording picks it up.
+		flush_video();
+		if (h264Encoder && !h264Encoder->SetBitrate(bitrate))
+			LOG(1, "Bitrate will change with the next recording");
+		// The warm encoder was set up with the old bitrate.
+		if (warmEncoder && !warmEncoder->SetBitrate(bitrate))
+			warmEncoder.reset();
 	}	
 
 	void sh_handle(std::vector<std::string> args)
@@ -660,49 +1337,404 @@ public:
 			throw std::runtime_error("expected at most 1 argument to `sh` command");
 
 		auto options = GetOptions();
-		options->sharpness = std::stof(args[0]);  // Use float for contrast
-		options->AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
+		options->sharpness = MjpegOptions::NormalizeRaspiMjpegScale(std::stof(args[0]));
 
-		StopCamera();
-		Teardown();
-		Configure(options);
-		StartCamera();
+		libcamera::ControlList controls(libcamera::controls::controls);
+		controls.set(libcamera::controls::Sharpness, options->sharpness);
+		apply_controls("sh", controls);
 	}
 
-	void preview_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-					libcamera::ControlList const &metadata)
+	libcamera::Size preview_size(StreamInfo const &info) const
 	{
-		StillOptions *options = &GetOptions()->previewOptions;
-		std::string const filename = options->output;
-		std::string const &cam_model = CameraModel();
+		StillOptions const *options = &GetOptions()->previewOptions;
 
 		// If opts.width == 0, we should use "the default"
-		options->width = (options->width >= 128 && options->width <= 1024) ? options->width : 512;
+		unsigned int width = (options->width >= 128 && options->width <= 1024) ? options->width : 512;
 
 		// Copied from RaspiMJPEG ;)
-		unsigned int height = (unsigned long int)options->width * info.height / info.width;
+		unsigned int height = (unsigned long int)width * info.height / info.width;
 		height -= height % 16;
-		options->height = height;
 
-		jpeg_save(mem, info, metadata, filename, cam_model, options, options->width, options->height);
+		return libcamera::Size(width, height);
+	}
+
+	// Hand the frame to the preview writer thread, so the JPEG encode and file write don't hold
+	// up the event loop. The completed request stays alive until it has been written.
+	void preview_save(CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		StillOptions const *options = &GetOptions()->previewOptions;
+		libcamera::Size size = preview_size(saved_info(stream));
+
+		if (!previewWriter)
+			previewWriter = std::make_unique<PreviewWriter>(this);
+		previewWriter->Submit(completed_request, stream, options, size.width, size.height, rotator);
+	}
+
+	void flush_preview()
+	{
+		if (previewWriter)
+			previewWriter->Flush();
+	}
+
+	// The web interface only polls the preview a few times a second, so there is no point
+	// encoding every frame. Throttle by the divider and preview fps limit.
+	void update_preview_pacing()
+	{
+		MjpegOptions const *options = GetOptions();
+		previewPacer.SetDivider(options->frameDivider);
+		// Nobody is watching, so update just often enough to be reasonably fresh when they come back.
+		float fps = preview_idle && options->preview_idle_fps > 0 ? options->preview_idle_fps : options->preview_fps;
+		if (preview_idle && options->preview_fps > 0)
+			fps = std::min(fps, options->preview_fps);
+		using namespace std::chrono;
+		previewPacer.SetInterval(fps > 0 ? duration_cast<nanoseconds>(duration<double>(1.0 / fps)) : nanoseconds(0));
+		LOG(1, "Preview divider " << options->frameDivider << ", fps limit " << fps << (preview_idle ? " (idle)" : ""));
+	}
+
+	// Watch for anyone reading the preview, so we can stop encoding it when nobody is.
+	void start_preview_demand()
+	{
+		MjpegOptions const *options = GetOptions();
+		if (previewDemand || !options->preview_idle_timeout || options->previewOptions.output.empty())
+			return;
+
+		try
+		{
+			previewDemand = std::make_unique<PreviewDemand>(options->previewOptions.output);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Cannot watch the preview, it will always be updated: " << e.what());
+		}
+	}
+
+	void update_preview_demand()
+	{
+		if (!previewDemand)
+			return;
+
+		bool idle = previewDemand->SinceLastRead() > std::chrono::seconds(GetOptions()->preview_idle_timeout);
+		if (idle == preview_idle)
+			return;
+
+		preview_idle = idle;
+		LOG(1, (idle ? "Nobody is reading the preview" : "Preview is being read again"));
+		update_preview_pacing();
+		// Someone just turned up, so give them a fresh frame straight away.
+		if (!idle)
+			previewPacer.Reset();
+	}
+
+	// Decide if this viewfinder frame should become a preview.
+	bool preview_due(CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		update_preview_demand();
+		if (preview_idle && GetOptions()->preview_idle_fps <= 0)
+		{
+			preview_idle_skipped++;
+			return false;
+		}
+
+		auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+		uint64_t timestamp = ts ? *ts : completed_request->buffers[stream]->metadata().timestamp;
+		return previewPacer.Accept(timestamp);
+	}
+
+	std::chrono::steady_clock::time_point last_preview_stats = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point last_worker_stats = std::chrono::steady_clock::now();
+
+	void log_worker_stats()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_worker_stats < std::chrono::seconds(10))
+			return;
+		last_worker_stats = now;
+
+		for (FrameWorker *worker : { videoWorker.get(), motionWorker.get() })
+		{
+			if (worker)
+				LOG(1, "Frame worker " << worker->Report());
+		}
+	}
+
+	void log_preview_stats()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (!previewWriter || now - last_preview_stats < std::chrono::seconds(10))
+			return;
+		last_preview_stats = now;
+
+		// Every frame we skipped is an encode we didn't have to do.
+		uint64_t skipped = previewPacer.Skipped() + preview_idle_skipped;
+		auto encode_time = previewWriter->AverageEncodeTime();
+		auto saved = std::chrono::duration_cast<std::chrono::milliseconds>(encode_time * skipped);
+		LOG(1, "Preview frames published: " << previewWriter->Published() << ", dropped: " << previewWriter->Dropped()
+											<< ", skipped: " << skipped << " (~" << saved.count()
+											<< "ms of encoding saved at " << encode_time.count() << "us each)"
+											<< (preview_idle ? ", idle" : ""));
 	}
 
-	void still_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-						libcamera::ControlList const &metadata, libcamera::Size outputSize)
+	// Zero shutter lag: we always hang on to the last frame, so when a still is asked for
+	// we can use whichever of it and the next one was exposed nearest to the `im` command,
+	// rather than whatever comes out after the command has made its way to us. Configure()
+	// asks for an extra buffer per stream to cover it.
+	CompletedRequestPtr zsl_previous;
+	std::optional<std::chrono::steady_clock::time_point> still_requested;
+
+	// Give the camera back any frames we're holding, before stopping it.
+	void drop_held_frames() { zsl_previous.reset(); }
+
+	static uint64_t frame_timestamp(CompletedRequestPtr const &completed_request, Stream *stream)
+	{
+		auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+		return ts ? *ts : completed_request->buffers[stream]->metadata().timestamp;
+	}
+
+	// Stills come from the largest processed stream we have (the ISP only has two outputs,
+	// the other being the preview).
+	Stream *still_stream() const
+	{
+		Stream *video = VideoStream();
+		Stream *viewfinder = ViewfinderStream();
+		if (!video || !viewfinder)
+			return video ? video : viewfinder;
+		return GetStreamInfo(video).width >= GetStreamInfo(viewfinder).width ? video : viewfinder;
+	}
+
+	// Called with every completed request.
+	void still_capture(CompletedRequestPtr &completed_request)
+	{
+		Stream *stream = still_stream();
+		if (GetOptions()->stillOptions.output.empty() || !stream)
+			return;
+
+		CompletedRequestPtr previous = std::move(zsl_previous);
+		zsl_previous = completed_request;
+		if (!still_active)
+			return;
+
+		// Started with --still-output and no FIFO: take the first frame we get.
+		if (!still_requested)
+			still_requested = std::chrono::steady_clock::now();
+
+		// SensorTimestamp is CLOCK_MONOTONIC, same as steady_clock.
+		int64_t requested = std::chrono::duration_cast<std::chrono::nanoseconds>(
+								still_requested->time_since_epoch()).count();
+		int64_t current = frame_timestamp(completed_request, stream);
+		// Exposed before we were asked, the next frame may be nearer.
+		if (current < requested)
+			return;
+
+		CompletedRequestPtr *chosen = &completed_request;
+		if (previous && requested - (int64_t)frame_timestamp(previous, stream) < current - requested)
+			chosen = &previous;
+
+		int64_t offset_us = ((int64_t)frame_timestamp(*chosen, stream) - requested) / 1000;
+		still_save(*chosen, stream);
+		LOG(2, "Still taken from frame " << (*chosen)->sequence << ", " << offset_us << "us from the request");
+
+		still_requested.reset();
+		still_active = false;
+	}
+
+	// Copy the frame out of the camera buffers, to be saved at the still size.
+	StillWriter::Item still_item(CompletedRequestPtr &completed_request, Stream *stream, std::string const &filename)
 	{
 		StillOptions const *options = &GetOptions()->stillOptions;
-		std::string const filename = make_name(options->output);
-		std::string const &cam_model = CameraModel();
-		jpeg_save(mem, info, metadata, filename, cam_model, options, outputSize.width, outputSize.height);
-		LOG(1, "Saved still capture: " + filename);
-		thumbnail_save(filename, 'i');
+		FrameRotator::FramePtr frame = saved_frame(completed_request, stream);
+
+		StillWriter::Item item;
+		item.image = StillWriter::Copy(frame->mem, frame->info);
+		item.metadata = completed_request->metadata;
+		item.filename = filename;
+		item.requested = std::chrono::steady_clock::now();
+
+		// Scale down if asked for a smaller still, never up.
+		item.width = item.image.info.width;
+		item.height = item.image.info.height;
+		if (options->width && options->height && options->width < item.width && options->height < item.height)
+		{
+			item.width = options->width & ~1;
+			item.height = options->height & ~1;
+		}
+		return item;
+	}
+
+	// Leave the encoding to the still writer, so we neither stall the event loop nor hold on
+	// to camera buffers while it's busy.
+	void still_save(CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		StillOptions const *options = &GetOptions()->stillOptions;
+		StillWriter::Item item = still_item(completed_request, stream, make_name(options->output));
+		item.requested = still_requested.value_or(*item.requested);
+
+		// The raw stream has the full sensor resolution.
+		Stream *raw_stream = RawStream();
+		if (options->raw && raw_stream && completed_request->buffers.count(raw_stream))
+		{
+			BufferReadSync r(this, completed_request->buffers[raw_stream]);
+			item.raw = StillWriter::Copy(r.Get(), GetStreamInfo(raw_stream));
+			std::filesystem::path raw_filename(item.filename);
+			item.raw_filename = raw_filename.replace_extension(".dng");
+		}
+
+		std::string const filename = item.filename;
+		index_media(filename, [this, &item](MediaIndex &index) {
+			index.AddMedia('i', image_count);
+			item.saved = [&index]() { index.Stamp(); };
+		});
+		run_macro(GetOptions()->start_img, { filename });
+		if (!GetOptions()->end_img.empty())
+		{
+			item.saved = [indexed = std::move(item.saved), hooks = &hooks(), macro = GetOptions()->end_img,
+						  filename]() {
+				if (indexed)
+					indexed();
+				hooks->Run(macro, { filename });
+			};
+		}
+		if (!stillWriter)
+			stillWriter = std::make_unique<StillWriter>("still capture", CameraModel(), options);
+		stillWriter->Submit(std::move(item));
+
+		if (auto thumbnail = thumbnail_make(filename, 'i', completed_request, stream))
+			thumbnail_save(std::move(*thumbnail));
 		image_count++;
 	};
 
+	// The timelapse takes frames from whichever stream stills come from, so it never needs the
+	// camera reconfiguring. Frames are picked by sensor timestamp, so the interval stays exact
+	// however late the event loop gets to them.
+	FramePacer lapsePacer;
+	// The first frame (or the video), which the thumbnail and media index go by.
+	std::string lapse_filename;
+	// Frames skipped because the writer hadn't caught up.
+	uint64_t lapse_skipped = 0;
+	// More than this many frames waiting to be written and we're falling behind.
+	static constexpr size_t LAPSE_MAX_PENDING = 4;
+
+	void tl_handle(std::vector<std::string> args)
+	{
+		if (args.size() < 1 || args[0] != "1")
+		{
+			lapse_stop();
+			return;
+		}
+		if (lapse_active)
+			return;
+		if (GetOptions()->lapse_output.empty())
+		{
+			LOG_ERROR("No lapse_path set, cannot start a timelapse");
+			return;
+		}
+
+		lapse_active = true;
+		lapse_count = 0;
+		lapse_skipped = 0;
+		lapse_filename.clear();
+		update_lapse_interval();
+		// Take the first frame straight away.
+		lapsePacer.Reset();
+	}
+
+	// tv NNNN - set the timelapse interval, in 0.1s units.
+	void tv_handle(std::vector<std::string> args)
+	{
+		if (args.size() != 1)
+			throw std::runtime_error("expected exactly 1 argument to `tv` command");
+
+		GetOptions()->tl_interval = std::max(std::stoi(args[0]), 1);
+		update_lapse_interval();
+	}
+
+	void update_lapse_interval()
+	{
+		lapsePacer.SetInterval(std::chrono::milliseconds(100 * std::max(GetOptions()->tl_interval, 1u)));
+	}
+
+	// Called with every completed request.
+	void lapse_capture(CompletedRequestPtr &completed_request)
+	{
+		Stream *stream = still_stream();
+		if (!lapse_active || !stream || !lapsePacer.Accept(frame_timestamp(completed_request, stream)))
+			return;
+
+		MjpegOptions *options = GetOptions();
+		bool video = TimelapseVideo::Wanted(options->lapse_output);
+		if (!video)
+		{
+			if (!lapseWriter)
+				lapseWriter = std::make_unique<StillWriter>("timelapse frame", CameraModel(), &options->stillOptions);
+			// Better to miss a frame than to fall further and further behind.
+			if (lapseWriter->Pending() >= LAPSE_MAX_PENDING)
+			{
+				lapse_skipped++;
+				LOG(1, "Timelapse writer is behind, skipped frame " << completed_request->sequence);
+				return;
+			}
+		}
+
+		// The whole timelapse is one image, numbered when it gets its first frame.
+		bool first = lapse_count++ == 0;
+		if (first)
+			lapse_image = image_count++;
+
+		if (video)
+		{
+			if (lapse_filename.empty())
+				lapse_filename = make_name(options->lapse_output, true, lapse_image);
+			FrameRotator::FramePtr frame = saved_frame(completed_request, stream);
+			if (!lapseVideo)
+			{
+				// The codec may have no room for another encoder, which shouldn't take the rest down.
+				try
+				{
+					lapseVideo = std::make_unique<TimelapseVideo>(options->videoOptions, lapse_filename, frame->info);
+				}
+				catch (std::exception const &e)
+				{
+					LOG_ERROR("Failed to start timelapse video, stopping the timelapse: " << e.what());
+					lapse_stop();
+					return;
+				}
+			}
+			lapseVideo->Append(completed_request, frame);
+		}
+		else
+		{
+			StillWriter::Item item =
+				still_item(completed_request, stream, make_name(options->lapse_output, true, lapse_image));
+			if (first)
+				lapse_filename = item.filename;
+			index_media(item.filename, [&item](MediaIndex &index) { item.saved = [&index]() { index.Stamp(); }; });
+			lapseWriter->Submit(std::move(item));
+		}
+
+		if (first)
+		{
+			index_media(lapse_filename, [this](MediaIndex &index) {
+				index.AddMedia('t', lapse_image);
+				index.Stamp();
+			});
+			if (auto thumbnail = thumbnail_make(lapse_filename, 't', completed_request, stream))
+				thumbnail_save(std::move(*thumbnail));
+		}
+	}
+
+	void lapse_stop()
+	{
+		if (!lapse_active)
+			return;
+		lapse_active = false;
+
+		lapseVideo.reset();
+		if (lapseWriter)
+			lapseWriter->Flush();
+		LOG(1, "Timelapse finished with " << lapse_count << " frames (" << lapse_skipped << " skipped)");
+	}
+
 	// video_save function using app to manage encoder and file output
-	void video_save(const std::vector<libcamera::Span<uint8_t>> &mem, const StreamInfo &info,
-				const libcamera::ControlList &metadata, const CompletedRequestPtr &completed_request,
-				Stream *stream)
+	void video_save(const CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		MjpegOptions *options = GetOptions();
 
@@ -710,10 +1742,17 @@ public:
 		// - We need to retain the original output name for future make_name calls.
 		// - We need to retain the result of make_name for future thumbnail_save calls.
 		if (options->videoOptions.output.empty())
+		{
 			options->videoOptions.output = make_name(options->video_output);
+			// Made from the first frame, but only saved once the recording is finished.
+			video_thumbnail = thumbnail_make(options->videoOptions.output, 'v', completed_request, stream);
+			// Whether started by `ca 1` or by motion.
+			run_macro(options->start_vid, { options->videoOptions.output });
+		}
 
 		// Use the app instance to call initialize_encoder
-		initialize_encoder(options->videoOptions, info);
+		bool warm = h264Encoder || warmEncoder;
+		initialize_encoder(options->videoOptions, saved_info(stream));
 
 		// Check if the encoder and file output were successfully initialized
 		if (!h264Encoder)
@@ -728,125 +1767,232 @@ public:
 			return;
 		}
 
-		// Get buffer to process
-		auto buffer = completed_request->buffers[stream];
-		int fd = buffer->planes()[0].fd.get(); // File descriptor of buffer
-		auto ts = metadata.get(libcamera::controls::SensorTimestamp);
-		int64_t timestamp_us = ts ? (*ts / 1000) : (buffer->metadata().timestamp / 1000);
-
-		// Ensure buffer is valid before encoding
-		if (mem.empty() || mem[0].size() == 0)
-		{
-			LOG_ERROR("Buffer is empty, cannot proceed.");
-			return;
-		}
-
-		// Encode the buffer using the H.264 encoder
-		//LOG(1, "Encoding buffer of size " << mem[0].size() << " at timestamp " << timestamp_us);
-		h264Encoder->EncodeBuffer(fd, mem[0].size(), mem[0].data(), info, timestamp_us);
+		video_submit(completed_request);
+		report_start_latency(warm);
 	}
 
-	// motion detect function
-	bool detected_ = false;
-	bool detected = false;
+	// Motion detection runs in its own thread, and the results are picked up from there.
+	static constexpr size_t MOTION_QUEUE_DEPTH = 2;
+	std::unique_ptr<FrameWorker> motionWorker;
+	std::mutex motion_mutex;
+	std::vector<std::pair<unsigned int, bool>> motion_results;
+
 	void motion_detect(CompletedRequestPtr &completed_request)
 	{
 		initialize_motion_detect_stage();
 		assert(motionDetectStage != nullptr);
 
-		motionDetectStage->Process(completed_request);
-		
-		completed_request->post_process_metadata.Get("motion_detect.result", detected);
-		std::string msg = detected ? "1" : "0";
+		if (!motionWorker)
+			motionWorker = std::make_unique<FrameWorker>("motion", MOTION_QUEUE_DEPTH, [this](CompletedRequestPtr &r) {
+				motionDetectStage->Process(r);
+				bool detected = false;
+				r->post_process_metadata.Get("motion_detect.result", detected);
+				std::lock_guard<std::mutex> lock(motion_mutex);
+				motion_results.emplace_back(r->sequence, detected);
+			});
+		motionWorker->Submit(completed_request);
+
+		std::vector<std::pair<unsigned int, bool>> results;
+		{
+			std::lock_guard<std::mutex> lock(motion_mutex);
+			results.swap(motion_results);
+		}
+		for (auto const &[sequence, detected] : results)
+			motion_update(sequence, detected);
+	}
+
+	void motion_update(unsigned int sequence, bool detected)
+	{
+		if (!motionTrigger)
+		{
+			MjpegOptions const *options = GetOptions();
+			motionTrigger = std::make_unique<MotionTrigger>(options->motion_initframes, options->motion_startframes,
+															options->motion_stopframes,
+															std::chrono::seconds(options->motion_clip));
+		}
+
+		MotionTrigger::Event event = motionTrigger->Update(detected);
+		if (event == MotionTrigger::Event::None)
+			return;
+
+		bool start = event == MotionTrigger::Event::Start;
+		LOG(1, "Motion " << (start ? "started" : "stopped") << " at frame " << sequence);
+
+		// The scheduler still gets told, for its macros.
 		static std::ofstream scheduler {GetOptions()->motion_output};
-		
-		if (detected_ != detected) 
+		scheduler << (start ? "1" : "0") << std::endl;
+		run_macro(GetOptions()->motion_event, { start ? "1" : "0" });
+
+		if (start)
+			motion_record_start();
+		else
+			motion_record_stop();
+	}
+
+	// Set when the recording in progress was started by motion, rather than `ca 1`.
+	bool motion_recording = false;
+
+	// Record straight away, rather than waiting for the scheduler to send `ca 1` back.
+	void motion_record_start()
+	{
+		if (video_active || GetOptions()->video_output.empty())
+			return;
+
+		video_active = true;
+		motion_recording = true;
+		video_requested = std::chrono::steady_clock::now();
+	}
+
+	void motion_record_stop()
+	{
+		if (!motion_recording)
+			return;
+
+		motion_recording = false;
+		cleanup();
+		video_active = false;
+		prewarm_encoder();
+	}
+
+	// RaspiMJPEG's macros, run in the background so they never hold up the frames.
+	std::unique_ptr<HookRunner> hookRunner;
+
+	HookRunner &hooks()
+	{
+		if (!hookRunner)
 		{
-			scheduler << msg << std::endl;
+			MjpegOptions const *options = GetOptions();
+			hookRunner = std::make_unique<HookRunner>(options->macros_path,
+													   std::chrono::seconds(options->callback_timeout));
 		}
+		return *hookRunner;
+	}
 
-		detected_ = detected;
+	void run_macro(std::string const &macro, std::vector<std::string> const &args)
+	{
+		if (!macro.empty())
+			hooks().Run(macro, args);
 	}
 
-	void set_counts()
+	// sy NAME [ARGS...] - run a script from macros_path.
+	void sy_handle(std::vector<std::string> args)
 	{
-		MjpegOptions *options = GetOptions();
+		if (args.size() < 1)
+			throw std::runtime_error("expected at least 1 argument to `sy` command");
+		// Only what is in macros_path.
+		if (GetOptions()->macros_path.empty() || args[0].find('/') != std::string::npos)
+		{
+			LOG_ERROR("`sy` can only run scripts in macros_path");
+			return;
+		}
 
-		auto get_highest_by_type = [](std::string filename, std::string types) {
-			auto base = filename.substr(0, filename.rfind("/"));
+		run_macro(args[0], std::vector<std::string>(args.begin() + 1, args.end()));
+	}
 
-			std::vector<std::string> filenames;
-			for (auto const& dir_entry : std::filesystem::directory_iterator(base)) {
-				if (!dir_entry.is_regular_file()) continue;
-				filenames.push_back(dir_entry.path());
-			}
+	// Media counters and thumbnails, by directory.
+	std::map<std::string, std::unique_ptr<MediaIndex>> media_indexes;
 
-			// Extract max <count> from Vec of "<name>.<type><count>.th.jpg"
-			int max_count = 0;
-			std::regex thumbnail_regex(".*.(t|i|v)([0-9]+).th.jpg");
-			std::smatch thumbnail_match;
-			for (auto &filename : filenames) {
-				// File didn't match thumbnail format
-				if (!std::regex_search(filename, thumbnail_match, thumbnail_regex))
-					continue;
-				std::string type = thumbnail_match[1];
-
-				// File didn't match required types
-				if (types.find(type) == std::string::npos)
-					continue;
-
-				int count = std::stoi(thumbnail_match[2]);
-				if (count > max_count) max_count = count;
-			}
-			return max_count;
-		};
+	// The index for the directory a media file or thumbnail is saved in.
+	MediaIndex &media_index(std::string const &filename)
+	{
+		std::string dir = std::filesystem::path(filename).parent_path();
+		if (dir.empty())
+			dir = ".";
+		std::unique_ptr<MediaIndex> &index = media_indexes[dir];
+		if (!index)
+			index = std::make_unique<MediaIndex>(dir);
+		return *index;
+	}
+
+	// Keep the index up to date as we save things. It'll get rebuilt if this goes wrong.
+	void index_media(std::string const &filename, std::function<void(MediaIndex &)> update)
+	{
+		try
+		{
+			update(media_index(filename));
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Failed to update media index for " << filename << ": " << e.what());
+		}
+	}
+
+	// Only scans the directories if the index is out of date.
+	void set_counts()
+	{
+		MjpegOptions *options = GetOptions();
 
 		if (!options->stillOptions.output.empty()) {
-			std::string example_filename = make_name(options->stillOptions.output);
-			image_count = get_highest_by_type(example_filename, "it") + 1;
+			MediaIndex &index = media_index(make_name(options->stillOptions.output));
+			index.Validate();
+			image_count = index.Highest("it") + 1;
 		}
 
 		if (!options->video_output.empty()) {
-			std::string example_filename = make_name(options->video_output);
-			video_count = get_highest_by_type(example_filename, "v") + 1;
+			MediaIndex &index = media_index(make_name(options->video_output));
+			index.Validate();
+			video_count = index.Highest("v") + 1;
 		}
 	}
 
-	void thumbnail_save(std::string filename, char type)
+	std::optional<StillWriter::Item> video_thumbnail;
+
+	// Downscale the frame a media file was made from into a thumbnail, if it should have one.
+	std::optional<StillWriter::Item> thumbnail_make(std::string const &filename, char type,
+													CompletedRequestPtr const &completed_request, Stream *stream)
 	{
 		assert((type == 'v' || type == 'i' || type == 't') && "Type must be one of v, i, t.");
 
 		MjpegOptions const *options = GetOptions();
-		if (options->media_path.empty()) return;
-		if (options->thumb_gen.empty()) return;
-		if (options->previewOptions.output.empty()) return;
+		if (options->media_path.empty()) return std::nullopt;
+		if (options->thumb_gen.empty()) return std::nullopt;
 
 		// Thumbnail generation for this type is disabled.
 		if (options->thumb_gen.find(type) == std::string::npos)
-			return;
+			return std::nullopt;
 
 		// Only generate thumbnails for files saved at the media path.
 		if (filename.rfind(options->media_path, 0) == std::string::npos)
-			return;
+			return std::nullopt;
 
-		int count = type == 'v' ? video_count : image_count;
+		int count = type == 'v' ? video_count : type == 't' ? lapse_image : image_count;
 		// TODO: We are supposed to replace subdirectories relative to media_path with options->subdir_char.
 		// - ie. /var/www/media/my/sub/directory/img.jpg should generate thumbnail /var/www/media/my@sub@directory@img.jpg.i1.th.jpg
 
 		std::stringstream buffer;
 		buffer << filename << "." << type << count << ".th.jpg";
 
-		// Use the current preview as the thumbnail.
-		std::string preview_filename = options->previewOptions.output;
-		std::string thumbnail_filename = buffer.str();
-		std::ifstream preview(preview_filename, std::ios::binary);
-		std::ofstream thumbnail(thumbnail_filename, std::ios::binary);
-		thumbnail << preview.rdbuf();
+		// Thumbnails are the same size as the preview. Only the small copy is kept, so the
+		// camera gets its buffer back straight away.
+		FrameRotator::FramePtr frame = saved_frame(completed_request, stream);
+		libcamera::Size size = preview_size(frame->info);
+
+		StillWriter::Item item;
+		item.image = StillWriter::Copy(frame->mem, frame->info, size.width & ~1, size.height);
+		item.metadata = completed_request->metadata;
+		item.filename = buffer.str();
+		item.width = item.image.info.width;
+		item.height = item.image.info.height;
+		return item;
+	}
 
-		LOG(2, "Saved thumbnail to " << thumbnail_filename);
+	void thumbnail_save(StillWriter::Item &&item)
+	{
+		index_media(item.filename, [&item](MediaIndex &index) {
+			item.saved = [&index, filename = item.filename]() {
+				index.AddThumbnail(filename);
+				index.Stamp();
+			};
+		});
+
+		if (!thumbnailWriter)
+			thumbnailWriter = std::make_unique<StillWriter>("thumbnail", CameraModel(), &GetOptions()->previewOptions);
+		thumbnailWriter->Submit(std::move(item));
 	}
 
-	std::string make_name(const std::string format, const bool is_filename = true)
+	// The image number (%i) is the next one, unless given.
+	std::string make_name(const std::string format, const bool is_filename = true,
+						  std::optional<int> image = std::nullopt)
 	{
 		auto options = GetOptions();
 		time_t tt = time(nullptr);
@@ -896,10 +2042,12 @@ public:
 			case 'v': // video #
 				buffer << std::to_string(video_count);
 				break;
-			case 'i': // image #
-			case 'l': // timelapse #
-				// FIXME: roberttidey RaspiMJPEG actually does use a lapse_cnt here...
-				buffer << std::to_string(image_count);
+			case 'i': // image # (a timelapse is one image)
+				buffer << std::to_string(image.value_or(image_count));
+				break;
+			case 't': // frame # within the timelapse
+			case 'l':
+				buffer << std::to_string(lapse_count);
 				break;
 			default: // Fallback for unrecognized / unsupported
 				LOG(1, "Unsupported f-string: " << format.substr(pos, 2));
@@ -935,6 +2083,56 @@ std::vector<std::string> tokenizer(const std::string& str, const std::string& de
 
     return tokens;
 }
+
+// Look up and run the handler for a single command line, returning false if there isn't one.
+static bool dispatch_command(RPiCamMjpegApp &app, const std::string &command,
+							 std::chrono::time_point<std::chrono::steady_clock> &start_time, int &duration_limit_seconds)
+{
+	LOG(1, "Got command from FIFO: " + command);
+
+	// Split the command by space
+	std::vector<std::string> tokens = tokenizer(command, " ");
+	std::vector<std::string> arguments = std::vector<std::string>(tokens.begin() + 1, tokens.end());
+	// check for existing command
+	auto it = app.commands.find(tokens[0]);
+	if (it != app.commands.end())
+	{
+		it->second(arguments, start_time, duration_limit_seconds); //Call associated command handler
+		return true;
+	}
+	else
+	{
+		std::cout << "Invalid command: " << tokens[0] << std::endl;
+		return false;
+	}
+}
+
+// Run a batch from the control socket. Unlike the FIFO a bad command only fails its batch, the
+// client is told which one straight away. The rest are acknowledged once they reach a frame.
+static void dispatch_batch(RPiCamMjpegApp &app, RPiCamApp::CommandBatch const &batch,
+						   std::chrono::time_point<std::chrono::steady_clock> &start_time, int &duration_limit_seconds)
+{
+	for (auto const &command : batch.commands)
+	{
+		std::string error;
+		try
+		{
+			if (!dispatch_command(app, command, start_time, duration_limit_seconds))
+				error = "invalid command";
+		}
+		catch (std::exception const &e)
+		{
+			error = e.what();
+		}
+
+		if (!error.empty())
+		{
+			app.controlSocket->Reply(batch.id, "ERR " + command + ": " + error + "\n");
+			return;
+		}
+	}
+	app.pending_acks.push_back(batch.id);
+}
 	
 
 
@@ -962,36 +2160,20 @@ static void event_loop(RPiCamMjpegApp &app)
 	}
 
 	// -1 indicates indefinte recording (until `ca 0` recv'd.)
-	int duration_limit_seconds = options->fifo.empty() ? 10 : -1;
+	int duration_limit_seconds = app.fifo_active() ? -1 : 10;
 	auto start_time = std::chrono::steady_clock::now();
 
 	app.set_counts();
 	LOG(2, "image_count: " << app.image_count << ", video_count: " << app.video_count);
 
+	app.update_preview_pacing();
+	app.start_preview_demand();
+	app.prewarm_encoder();
+	app.start_preroll();
+	app.start_command_fifo();
+
 	while (app.video_active || app.preview_active || app.still_active || app.motion_active || app.fifo_active())
 	{
-		// Check if there are any commands over the FIFO.
-		std::string fifo_command = app.get_fifo_command();
-		if (!fifo_command.empty())
-		{			
-			LOG(1, "Got command from FIFO: " + fifo_command);
-
-			// Split the fifo_command by space
-			std::vector<std::string> tokens = tokenizer(fifo_command, " ");
-			std::vector<std::string> arguments = std::vector<std::string>(tokens.begin() + 1, tokens.end());
-			// check for existing command
-			auto it = app.commands.find(tokens[0]);
-			if (it != app.commands.end())
-			{
-				app.commands[tokens[0]](arguments, start_time, duration_limit_seconds); //Call associated command handler
-			}
-			else
-			{
-				std::cout << "Invalid command: " << tokens[0] << std::endl;
-			}
-
-		}
-
 		app.write_status();
 
 		// If video is active and a duration is set, check the elapsed time
@@ -1013,6 +2195,9 @@ static void event_loop(RPiCamMjpegApp &app)
 				std::cout << "time limit: " << duration_limit_seconds << " seconds is reached. stop." << std::endl;
 				app.cleanup();
 				app.video_active = false;
+				app.motion_recording = false;
+				// Don't cut short the next (motion) recording.
+				duration_limit_seconds = -1;
 			}
 		}
 
@@ -1024,43 +2209,57 @@ static void event_loop(RPiCamMjpegApp &app)
 		}
 
 
-		RPiCamApp::Msg msg = app.Wait();
+		// Restart the camera if a burst of reconfiguring commands has finished.
+		app.reconfigure_if_due();
+
+		// Don't sleep past a pending reconfiguration, frames may be slow or stalled.
+		std::optional<RPiCamApp::Msg> next;
+		if (app.reconfigure_pending())
+			next = app.Wait(app.reconfigure_timeout());
+		else
+			next = app.Wait();
+		if (!next)
+			continue;
+
+		RPiCamApp::Msg &msg = *next;
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			app.restart_after_timeout();
 			continue;
 		}
 		if (msg.type == RPiCamApp::MsgType::Quit)
 			return;
+		else if (msg.type == RPiCamApp::MsgType::Command)
+		{
+			if (auto batch = std::get_if<RPiCamApp::CommandBatch>(&msg.payload))
+				dispatch_batch(app, *batch, start_time, duration_limit_seconds);
+			else
+				dispatch_command(app, std::get<std::string>(msg.payload), start_time, duration_limit_seconds);
+			continue;
+		}
 		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		app.count_frame();
+		app.report_blackout();
+		app.report_controls_latency(completed_request);
+		app.update_crop();
+		app.acknowledge(completed_request);
+		app.still_capture(completed_request);
+		app.lapse_capture(completed_request);
 
 		// Process the Viewfinder (Preview) stream
 		if (app.ViewfinderStream())
 		{
 			Stream *viewfinder_stream = app.ViewfinderStream();
-			StreamInfo viewfinder_info = app.GetStreamInfo(viewfinder_stream);
-			BufferReadSync r(&app, completed_request->buffers[viewfinder_stream]);
-			const std::vector<libcamera::Span<uint8_t>> viewfinder_mem = r.Get();
 
-			if (app.still_active)
-			{
-				// Save still image instead of preview when still_active is set
-				app.still_save(viewfinder_mem, viewfinder_info, completed_request->metadata,
-                            libcamera::Size(3200, 2400));
-
-				LOG(2, "Still image saved");
-				app.still_active = false;
-			}
-			else if (app.preview_active || app.multi_active)
+			if ((app.preview_active || app.multi_active) && app.preview_due(completed_request, viewfinder_stream))
 			{
 				// Save preview if not in still mode
-				app.preview_save(viewfinder_mem, viewfinder_info, completed_request->metadata);
-				LOG(2, "Viewfinder (Preview) image saved");
+				app.preview_save(completed_request, viewfinder_stream);
+				LOG_RATE_LIMITED(2, 1000, "Viewfinder (Preview) image queued");
 			}
 			if (app.motion_active)
 			{
@@ -1073,16 +2272,17 @@ static void event_loop(RPiCamMjpegApp &app)
 		{
 			// LOG(1, "here");
 			Stream *video_stream = app.VideoStream();
-			StreamInfo video_info = app.GetStreamInfo(video_stream);
-			BufferReadSync r(&app, completed_request->buffers[video_stream]);
-			const std::vector<libcamera::Span<uint8_t>> video_mem = r.Get();
-			if (app.video_active)
+			if (app.video_active && app.video_due(completed_request, video_stream))
 			{
-				app.video_save(video_mem, video_info, completed_request->metadata, completed_request, video_stream);
-				LOG(2, "Video recorded and saved");
+				app.video_save(completed_request, video_stream);
+				LOG_RATE_LIMITED(2, 1000, "Video recorded and saved");
 			}
+			else
+				app.preroll_save(completed_request);
 		}
-		LOG(2, "Request processing completed, current status: " + app.status());
+		app.log_preview_stats();
+		app.log_worker_stats();
+		LOG_RATE_LIMITED(2, 1000, "Request processing completed, current status: " + app.status());
 	}
 }
 
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * rpicam_mjpeg_status.cpp - dump the status block published by rpicam-mjpeg.
+ */
+
+#include <iostream>
+
+#include "status_block.hpp"
+
+int main(int argc, char *argv[])
+{
+	std::string path = argc > 1 ? argv[1] : "/dev/shm/mjpeg/status_mjpeg.shm";
+	try
+	{
+		StatusData data = StatusBlock::Read(path);
+		std::cout << "running: " << (StatusBlock::Running(data) ? "yes" : "no") << std::endl;
+		std::cout << "pid: " << data.pid << std::endl;
+		std::cout << "state: " << data.state << std::endl;
+		std::cout << "error: " << data.error << std::endl;
+		std::cout << "updated_ns: " << data.updated_ns << std::endl;
+		std::cout << "frames: " << data.frames << std::endl;
+		std::cout << "fps: " << data.fps << std::endl;
+		std::cout << "restarts: " << data.restarts << std::endl;
+		std::cout << "image_count: " << data.image_count << std::endl;
+		std::cout << "video_count: " << data.video_count << std::endl;
+		std::cout << "lapse_count: " << data.lapse_count << std::endl;
+		std::cout << "still_queue: " << data.still_queue << std::endl;
+		std::cout << "thumbnail_queue: " << data.thumbnail_queue << std::endl;
+		std::cout << "lapse_queue: " << data.lapse_queue << std::endl;
+		std::cout << "macro_queue: " << data.macro_queue << std::endl;
+		std::cout << "previews_published: " << data.previews_published << std::endl;
+		std::cout << "previews_dropped: " << data.previews_dropped << std::endl;
+		std::cout << "macros_dropped: " << data.macros_dropped << std::endl;
+		std::cout << "macros_timed_out: " << data.macros_timed_out << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * status_block.cpp - publish the app status and statistics in shared memory.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include "status_block.hpp"
+
+static std::runtime_error error(std::string const &what, std::string const &path)
+{
+	return std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+StatusBlock::StatusBlock(std::string const &path) : pid_(getpid())
+{
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw error("failed to open", path);
+	if (ftruncate(fd, sizeof(Shared)) < 0)
+	{
+		close(fd);
+		throw error("failed to size", path);
+	}
+	void *mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		throw error("failed to map", path);
+
+	// Readers ignore it until it has the right magic, and while the sequence is odd.
+	shared_ = static_cast<Shared *>(mem);
+	shared_->magic = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	new (&shared_->sequence) std::atomic<uint32_t>(1);
+	shared_->version = VERSION;
+	shared_->size = sizeof(StatusData);
+	memset(&shared_->data, 0, sizeof(StatusData));
+	shared_->sequence.store(2, std::memory_order_release);
+	shared_->magic = MAGIC;
+}
+
+StatusBlock::~StatusBlock()
+{
+	StatusData data = shared_->data;
+	data.pid = 0;
+	update(data);
+	munmap(shared_, sizeof(Shared));
+}
+
+void StatusBlock::Publish(StatusData const &data)
+{
+	StatusData copy = data;
+	copy.pid = pid_;
+	update(copy);
+}
+
+void StatusBlock::update(StatusData const &data)
+{
+	uint32_t sequence = shared_->sequence.load(std::memory_order_relaxed);
+	shared_->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&shared_->data, &data, sizeof(StatusData));
+	shared_->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+StatusData StatusBlock::Read(std::string const &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw error("failed to open", path);
+	void *mem = mmap(nullptr, sizeof(Shared), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		throw error("failed to map", path);
+
+	Shared const *shared = static_cast<Shared const *>(mem);
+	StatusData data;
+	bool consistent = false;
+	if (shared->magic == MAGIC && shared->version == VERSION && shared->size == sizeof(StatusData))
+	{
+		// The writer only holds it for a memcpy, so this never takes long.
+		for (unsigned int tries = 0; tries < 1000 && !consistent; tries++)
+		{
+			uint32_t before = shared->sequence.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			memcpy(&data, &shared->data, sizeof(StatusData));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			consistent = shared->sequence.load(std::memory_order_relaxed) == before;
+		}
+	}
+	munmap(mem, sizeof(Shared));
+
+	if (!consistent)
+		throw std::runtime_error("no status published in " + path);
+	return data;
+}
+
+bool StatusBlock::Running(StatusData const &data)
+{
+	// EPERM means it's there, only not ours to signal.
+	return data.pid > 0 && (kill(data.pid, 0) == 0 || errno == EPERM);
+}
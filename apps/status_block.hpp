@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * status_block.hpp - publish the app status and statistics in shared memory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// What is published. Fixed size and plain data, so readers in other processes can copy it
+// straight out of the mapping. Only ever add to the end, and bump StatusBlock::VERSION.
+struct StatusData
+{
+	char state[32]; // as written to the status file, without the error
+	char error[224]; // empty unless we hit an error
+	uint64_t updated_ns; // CLOCK_REALTIME
+	uint64_t frames; // completed requests since start
+	float fps; // over the last second or so
+	uint32_t restarts;
+	int32_t image_count;
+	int32_t video_count;
+	int32_t lapse_count;
+	// Queue depths
+	uint32_t still_queue;
+	uint32_t thumbnail_queue;
+	uint32_t lapse_queue;
+	uint32_t macro_queue;
+	uint64_t previews_published;
+	uint64_t previews_dropped;
+	uint32_t macros_dropped;
+	uint32_t macros_timed_out;
+	int32_t pid; // of the writer, filled in by StatusBlock and 0 once the writer has gone
+};
+
+// A file (normally in /dev/shm) mapped by the app and by anyone who wants to watch it, instead
+// of polling the status text file. Updates are protected by a sequence lock: the writer never
+// waits, and readers retry if they catch it part way through an update.
+class StatusBlock
+{
+public:
+	static constexpr uint32_t MAGIC = 0x534a504d; // "MPJS"
+	static constexpr uint32_t VERSION = 2;
+
+	// Create (or take over) the block, for the app to write.
+	StatusBlock(std::string const &path);
+	// Leaves the last status there to be read, but marked as no longer running.
+	~StatusBlock();
+
+	void Publish(StatusData const &data);
+
+	// Take a consistent copy of the block at the path, for readers.
+	static StatusData Read(std::string const &path);
+	// Whether the process that wrote it is still there, even if it died without saying so.
+	static bool Running(StatusData const &data);
+
+private:
+	struct Shared
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t size;
+		// Odd while an update is in progress.
+		std::atomic<uint32_t> sequence;
+		StatusData data;
+	};
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "sequence must work across processes");
+
+	void update(StatusData const &data);
+
+	Shared *shared_;
+	int32_t pid_;
+};
@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * still_writer.cpp - encode and save still captures off the event loop.
+ */
+
+#include <cstdio>
+
+#include <libcamera/formats.h>
+
+#include "core/logging.hpp"
+#include "core/still_options.hpp"
+#include "image/image.hpp"
+
+#include "still_writer.hpp"
+
+StillWriter::StillWriter(std::string const &what, std::string const &cam_model, StillOptions const *options)
+	: what_(what), cam_model_(cam_model), options_(options)
+{
+	thread_ = std::thread(&StillWriter::writeThread, this);
+}
+
+StillWriter::~StillWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_all();
+	}
+	thread_.join();
+}
+
+StillWriter::Frame StillWriter::Copy(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+								   unsigned int width, unsigned int height)
+{
+	Frame frame;
+	frame.info = info;
+	if (!width || !height || (width == info.width && height == info.height))
+	{
+		for (auto const &span : mem)
+			frame.data.insert(frame.data.end(), span.begin(), span.end());
+		return frame;
+	}
+
+	if (info.pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("can only downscale YUV420 frames");
+
+	frame.info.width = width;
+	frame.info.height = height;
+	frame.info.stride = width;
+	frame.data.resize(width * height * 3 / 2);
+
+	// Same layout as the camera buffer, but without any padding.
+	uint8_t const *Y = mem[0].data();
+	uint8_t const *U = Y + info.stride * info.height;
+	uint8_t const *V = U + (info.stride / 2) * (info.height / 2);
+	uint8_t *dst = frame.data.data();
+
+	std::vector<unsigned int> h_offset(width);
+	for (unsigned int x = 0; x < width; x++)
+		h_offset[x] = x * info.width / width;
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint8_t const *row = Y + (y * info.height / height) * info.stride;
+		for (unsigned int x = 0; x < width; x++)
+			*dst++ = row[h_offset[x]];
+	}
+	for (uint8_t const *plane : { U, V })
+	{
+		for (unsigned int y = 0; y < height / 2; y++)
+		{
+			uint8_t const *row = plane + (y * info.height / height) * (info.stride / 2);
+			for (unsigned int x = 0; x < width / 2; x++)
+				*dst++ = row[h_offset[2 * x] / 2];
+		}
+	}
+
+	return frame;
+}
+
+void StillWriter::Submit(Item &&item)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	queue_.push(std::move(item));
+	cond_var_.notify_one();
+}
+
+void StillWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_cond_var_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+size_t StillWriter::Pending()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return queue_.size() + busy_;
+}
+
+void StillWriter::writeThread()
+{
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		busy_ = false;
+		idle_cond_var_.notify_all();
+		// Must check the queue before the abort, so that everything gets saved.
+		cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+		if (queue_.empty())
+			return;
+
+		Item item = std::move(queue_.front());
+		queue_.pop();
+		busy_ = true;
+		lock.unlock();
+
+		try
+		{
+			write(item);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Failed to save " << what_ << " " << item.filename << ": " << e.what());
+		}
+	}
+}
+
+static void save_atomically(std::string const &filename, std::function<void(std::string const &)> save)
+{
+	std::string const tmp_filename = filename + ".part";
+	save(tmp_filename);
+	if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("failed to rename " + tmp_filename + " to " + filename);
+}
+
+void StillWriter::write(Item const &item)
+{
+	if (!item.raw.data.empty())
+	{
+		std::vector<libcamera::Span<uint8_t>> mem { { const_cast<uint8_t *>(item.raw.data.data()), item.raw.data.size() } };
+		save_atomically(item.raw_filename, [&](std::string const &filename) {
+			dng_save(mem, item.raw.info, item.metadata, filename, cam_model_, options_);
+		});
+	}
+
+	std::vector<libcamera::Span<uint8_t>> mem { { const_cast<uint8_t *>(item.image.data.data()), item.image.data.size() } };
+	save_atomically(item.filename, [&](std::string const &filename) {
+		jpeg_save(mem, item.image.info, item.metadata, filename, cam_model_, options_, item.width, item.height);
+	});
+
+	if (item.requested)
+	{
+		auto latency =
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *item.requested);
+		LOG(1, "Saved " << what_ << ": " << item.filename << " (" << latency.count() << "ms shutter to file)");
+	}
+	else
+		LOG(1, "Saved " << what_ << ": " << item.filename);
+
+	if (item.saved)
+		item.saved();
+}
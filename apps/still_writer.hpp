@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * still_writer.hpp - encode and save still captures off the event loop.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/controls.h>
+
+#include "core/stream_info.hpp"
+
+struct StillOptions;
+
+// Saves still captures in its own thread, in the order they were submitted. Frames are
+// copied out of the camera buffers when submitted, so the camera gets them back at once
+// and a burst of captures doesn't starve it. Files are renamed into place when complete.
+// Also used for thumbnails, which are downscaled when copied.
+class StillWriter
+{
+public:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		StreamInfo info;
+	};
+
+	struct Item
+	{
+		Frame image;
+		// Only saved (as DNG) if there is any data.
+		Frame raw;
+		libcamera::ControlList metadata;
+		std::string filename;
+		std::string raw_filename;
+		unsigned int width;
+		unsigned int height;
+		// When the capture was asked for, to report the shutter to file latency. Not set for
+		// thumbnails, which are made from a frame that has already been saved.
+		std::optional<std::chrono::steady_clock::time_point> requested;
+		// Called from the writer thread once the files are in place.
+		std::function<void()> saved;
+	};
+
+	// What we are writing is only used for logging.
+	StillWriter(std::string const &what, std::string const &cam_model, StillOptions const *options);
+	// Anything still queued is written out first.
+	~StillWriter();
+
+	// Copy a YUV420 frame out of the camera buffer, downscaling it (nearest neighbour) if smaller
+	// dimensions are given. Both must be even.
+	static Frame Copy(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+					  unsigned int width = 0, unsigned int height = 0);
+
+	void Submit(Item &&item);
+	// Wait until everything submitted so far is written. Call before changing the options.
+	void Flush();
+	// How many are waiting to be written, including any being written now.
+	size_t Pending();
+
+private:
+	void writeThread();
+	void write(Item const &item);
+
+	std::string what_;
+	std::string cam_model_;
+	StillOptions const *options_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::condition_variable idle_cond_var_;
+	std::queue<Item> queue_;
+	bool busy_ = false;
+	bool abort_ = false;
+	std::thread thread_;
+};
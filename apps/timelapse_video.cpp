@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * timelapse_video.cpp - append timelapse frames to a growing MJPEG or H.264 file.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/video_options.hpp"
+#include "encoder/encoder.hpp"
+
+#include "timelapse_video.hpp"
+
+static std::string codec_for(std::string const &filename)
+{
+	std::string ext = std::filesystem::path(filename).extension();
+	if (ext == ".mjpeg" || ext == ".mjpg")
+		return "mjpeg";
+	if (ext == ".h264")
+		return "h264";
+	return "";
+}
+
+bool TimelapseVideo::Wanted(std::string const &filename)
+{
+	return !codec_for(filename).empty();
+}
+
+TimelapseVideo::TimelapseVideo(VideoOptions const &options, std::string const &filename, StreamInfo const &info)
+	: options_(std::make_unique<VideoOptions>(options)), filename_(filename), info_(info)
+{
+	options_->codec = codec_for(filename);
+	if (options_->codec.empty())
+		throw std::runtime_error("don't know how to append video to " + filename);
+	// We write the file, the encoder only hands us what it has encoded.
+	options_->output = "";
+	frame_time_us_ = 1000000 / options_->framerate.value_or(DEFAULT_FRAMERATE);
+
+	fp_ = fopen(filename.c_str(), "ab");
+	if (!fp_)
+		throw std::runtime_error("failed to open " + filename + ": " + strerror(errno));
+
+	try
+	{
+		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(options_.get(), info));
+	}
+	catch (...)
+	{
+		fclose(fp_);
+		throw;
+	}
+	encoder_->SetInputDoneCallback([this](void *mem) { inputDone(mem); });
+	encoder_->SetOutputReadyCallback(
+		[this](void *mem, size_t size, int64_t, bool) { outputReady(mem, size); });
+
+	LOG(1, "Appending timelapse to " << filename << " (" << options_->codec << ")");
+}
+
+TimelapseVideo::~TimelapseVideo()
+{
+	// Lets the encoder finish what it has (and hand back the camera buffers) first.
+	encoder_.reset();
+	fclose(fp_);
+	LOG(1, "Appended " << frames_ << " timelapse frames to " << filename_);
+}
+
+void TimelapseVideo::Append(CompletedRequestPtr const &completed_request, FrameRotator::FramePtr const &frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		encoding_.emplace_back(completed_request, frame);
+	}
+	// Evenly spaced at the playback rate, whatever the interval they were taken at.
+	libcamera::Span<uint8_t> mem = frame->mem[0];
+	encoder_->EncodeBuffer(frame->fd, mem.size(), mem.data(), info_, frames_++ * frame_time_us_);
+}
+
+// Encoders that never drop frames are done with them in the order they were given, and don't
+// say which.
+void TimelapseVideo::inputDone(void *mem)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = encoding_.begin();
+	if (mem)
+		it = std::find_if(encoding_.begin(), encoding_.end(),
+						  [mem](auto const &item) { return item.second->mem[0].data() == mem; });
+	if (it != encoding_.end())
+		encoding_.erase(it);
+}
+
+// Runs in the encoder's output thread.
+void TimelapseVideo::outputReady(void *mem, size_t size)
+{
+	// Flushed every frame so that the file on disk is always playable up to the last one.
+	if (fwrite(mem, size, 1, fp_) != 1 || fflush(fp_) != 0)
+		LOG_ERROR("Failed to write timelapse frame to " << filename_ << ": " << strerror(errno));
+}
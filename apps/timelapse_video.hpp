@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * timelapse_video.hpp - append timelapse frames to a growing MJPEG or H.264 file.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
+
+#include "frame_rotator.hpp"
+
+class Encoder;
+struct VideoOptions;
+
+// Encodes timelapse frames straight into one video file, rather than leaving a JPEG per frame
+// to be stitched together afterwards. The file is a raw MJPEG (concatenated JPEGs) or H.264
+// elementary stream and is only ever appended to, so it can be played while it grows, survives
+// being cut off, and a new instance (after the camera restarts, say) simply carries on at the end.
+class TimelapseVideo
+{
+public:
+	// Is this a file name we can append video to, rather than a JPEG per frame?
+	static bool Wanted(std::string const &filename);
+
+	// Encoded with the given options, but played back at their frame rate regardless of the interval.
+	TimelapseVideo(VideoOptions const &options, std::string const &filename, StreamInfo const &info);
+	// Finishes encoding whatever it has been given.
+	~TimelapseVideo();
+
+	// The frame, and the completed request it came from, are held until the encoder has finished
+	// with them.
+	void Append(CompletedRequestPtr const &completed_request, FrameRotator::FramePtr const &frame);
+
+	uint64_t Frames() const { return frames_; }
+
+private:
+	void inputDone(void *mem);
+	void outputReady(void *mem, size_t size);
+
+	// The encoder keeps a pointer to these.
+	std::unique_ptr<VideoOptions> options_;
+	std::string filename_;
+	StreamInfo info_;
+	FILE *fp_ = nullptr;
+	std::mutex mutex_;
+	std::deque<std::pair<CompletedRequestPtr, FrameRotator::FramePtr>> encoding_;
+	uint64_t frames_ = 0;
+	int64_t frame_time_us_;
+	std::unique_ptr<Encoder> encoder_;
+};
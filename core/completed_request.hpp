@@ -30,6 +30,8 @@ struct CompletedRequest
 	ControlList metadata;
 	Request *request;
 	float framerate;
+	// Set when this request carried controls queued with RPiCamApp::SetControls.
+	bool controls_applied = false;
 	Metadata post_process_metadata;
 };
 
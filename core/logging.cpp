@@ -0,0 +1,300 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * logging.cpp - LOG macros, written out by a background thread.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/logging.hpp"
+
+namespace logging
+{
+
+namespace
+{
+
+// Grows to fit the longest message, and is then reused without allocating.
+class Buffer : public std::streambuf
+{
+public:
+	Buffer() : stream_(this) {}
+
+	std::ostream &Start()
+	{
+		data_.clear();
+		stream_.clear();
+		return stream_;
+	}
+	std::string const &Data() const { return data_; }
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (c != traits_type::eof())
+			data_.push_back(traits_type::to_char_type(c));
+		return c;
+	}
+	std::streamsize xsputn(char const *s, std::streamsize n) override
+	{
+		data_.append(s, n);
+		return n;
+	}
+
+private:
+	std::string data_;
+	std::ostream stream_;
+};
+
+// Single producer (the thread it belongs to), single consumer (whoever holds the drain lock).
+// Records are a header followed by the text, and may wrap round the end.
+class Ring
+{
+public:
+	static constexpr size_t SIZE = 64 * 1024;
+
+	struct Header
+	{
+		uint64_t sequence;
+		uint32_t length;
+	};
+
+	bool Push(uint64_t sequence, std::string const &text)
+	{
+		Header header { sequence, (uint32_t)text.size() };
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t tail = tail_.load(std::memory_order_acquire);
+		if (SIZE - (head - tail) < sizeof(header) + text.size())
+			return false;
+
+		copyIn(head, &header, sizeof(header));
+		copyIn(head + sizeof(header), text.data(), text.size());
+		head_.store(head + sizeof(header) + text.size(), std::memory_order_release);
+		return true;
+	}
+
+	template <typename F>
+	void Pop(F f)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t head = head_.load(std::memory_order_acquire);
+		std::string text;
+		while (tail != head)
+		{
+			Header header;
+			copyOut(tail, &header, sizeof(header));
+			text.resize(header.length);
+			copyOut(tail + sizeof(header), &text[0], header.length);
+			tail += sizeof(header) + header.length;
+			f(header.sequence, std::move(text));
+		}
+		tail_.store(tail, std::memory_order_release);
+	}
+
+	// The thread it belongs to has gone.
+	std::atomic<bool> closed { false };
+
+private:
+	void copyIn(size_t pos, void const *src, size_t size)
+	{
+		size_t offset = pos % SIZE, first = std::min(size, SIZE - offset);
+		memcpy(&data_[offset], src, first);
+		memcpy(&data_[0], static_cast<char const *>(src) + first, size - first);
+	}
+	void copyOut(size_t pos, void *dst, size_t size) const
+	{
+		size_t offset = pos % SIZE, first = std::min(size, SIZE - offset);
+		memcpy(dst, &data_[offset], first);
+		memcpy(static_cast<char *>(dst) + first, &data_[0], size - first);
+	}
+
+	char data_[SIZE];
+	// Total bytes ever written and read, so full and empty can't be confused.
+	std::atomic<size_t> head_ { 0 };
+	std::atomic<size_t> tail_ { 0 };
+};
+
+class Logger
+{
+public:
+	// How long the background thread lets messages collect once woken, to write them out together.
+	static constexpr std::chrono::milliseconds INTERVAL { 10 };
+
+	Logger() : thread_(&Logger::drainThread, this) { std::atexit([] { Flush(); }); }
+
+	std::shared_ptr<Ring> NewRing()
+	{
+		auto ring = std::make_shared<Ring>();
+		std::lock_guard<std::mutex> lock(rings_mutex_);
+		rings_.push_back(ring);
+		return ring;
+	}
+
+	uint64_t NextSequence() { return sequence_.fetch_add(1, std::memory_order_relaxed); }
+	void Dropped() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+	// Something has been queued (or dropped). Only the first since the last drain wakes the
+	// background thread, so it sleeps for as long as nothing is logged.
+	void Queued()
+	{
+		if (queued_.exchange(true, std::memory_order_acq_rel))
+			return;
+		std::lock_guard<std::mutex> lock(wake_mutex_);
+		wake_cond_var_.notify_one();
+	}
+
+	// Write out everything queued, then the text if there is any.
+	void Drain(std::string const *text = nullptr)
+	{
+		std::lock_guard<std::mutex> lock(drain_mutex_);
+		{
+			std::lock_guard<std::mutex> lock(rings_mutex_);
+			auto end = rings_.begin();
+			for (auto &ring : rings_)
+			{
+				// Its thread may still push (and then close) while we empty it, so it can only go
+				// if it had closed before we started.
+				bool closed = ring->closed.load(std::memory_order_acquire);
+				ring->Pop([this](uint64_t sequence, std::string &&text) {
+					pending_.emplace_back(sequence, std::move(text));
+				});
+				if (!closed)
+					*end++ = std::move(ring);
+			}
+			rings_.erase(end, rings_.end());
+		}
+
+		// Each ring is in order, but they need merging.
+		std::sort(pending_.begin(), pending_.end(),
+				  [](auto const &a, auto const &b) { return a.first < b.first; });
+		out_.clear();
+		if (unsigned int dropped = dropped_.exchange(0))
+			out_ += std::to_string(dropped) + " log messages dropped, the log can't keep up\n";
+		for (auto const &[sequence, text] : pending_)
+			out_.append(text).push_back('\n');
+		pending_.clear();
+		if (text)
+			out_.append(*text).push_back('\n');
+
+		for (size_t done = 0; done < out_.size();)
+		{
+			ssize_t ret = write(STDERR_FILENO, out_.data() + done, out_.size() - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+	}
+
+private:
+	void drainThread()
+	{
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(wake_mutex_);
+				wake_cond_var_.wait(lock, [this] { return queued_.load(std::memory_order_acquire); });
+			}
+			std::this_thread::sleep_for(INTERVAL);
+			// Anything queued from here on wakes us again.
+			queued_.exchange(false, std::memory_order_acq_rel);
+			Drain();
+		}
+	}
+
+	std::mutex rings_mutex_;
+	std::vector<std::shared_ptr<Ring>> rings_;
+	std::mutex drain_mutex_;
+	std::vector<std::pair<uint64_t, std::string>> pending_;
+	std::string out_;
+	std::atomic<uint64_t> sequence_ { 0 };
+	std::atomic<unsigned int> dropped_ { 0 };
+	std::atomic<bool> queued_ { false };
+	std::mutex wake_mutex_;
+	std::condition_variable wake_cond_var_;
+	std::thread thread_;
+};
+
+// Never destroyed, so that logging still works while other statics are being destroyed.
+Logger &logger()
+{
+	static Logger *logger = new Logger;
+	return *logger;
+}
+
+struct ThreadState
+{
+	~ThreadState()
+	{
+		if (ring)
+			ring->closed.store(true, std::memory_order_release);
+	}
+
+	std::shared_ptr<Ring> ring;
+	// One per level of nesting, in case formatting a message logs something itself.
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	unsigned int depth = 0;
+};
+
+thread_local ThreadState state;
+
+} // namespace
+
+Message::Message(Mode mode) : mode_(mode)
+{
+	if (state.buffers.size() <= state.depth)
+		state.buffers.push_back(std::make_unique<Buffer>());
+	stream_ = &state.buffers[state.depth++]->Start();
+}
+
+Message::~Message()
+{
+	std::string const &text = state.buffers[--state.depth]->Data();
+	if (mode_ == Now)
+	{
+		logger().Drain(&text);
+		return;
+	}
+
+	if (!state.ring)
+		state.ring = logger().NewRing();
+	if (!state.ring->Push(logger().NextSequence(), text))
+		logger().Dropped();
+	logger().Queued();
+}
+
+bool Allow(RateLimit &limit, unsigned int interval_ms, unsigned int &suppressed)
+{
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					  std::chrono::steady_clock::now().time_since_epoch()).count();
+	int64_t next = limit.next_ns.load(std::memory_order_relaxed);
+	if (now < next || !limit.next_ns.compare_exchange_strong(next, now + interval_ms * 1000000ll))
+	{
+		limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	suppressed = limit.suppressed.exchange(0, std::memory_order_relaxed);
+	return true;
+}
+
+void Flush()
+{
+	logger().Drain();
+}
+
+} // namespace logging
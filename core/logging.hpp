@@ -1,9 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Dylan Lom, She Xin Lim, Zian Li, Ching-Cheng Lu, Aiden Sloots, Ning Bao, Hanqi Zhang, Yucheng Yan
+ *
+ * logging.hpp - LOG macros, written out by a background thread.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
 #include "core/rpicam_app.hpp"
 
+// Messages above this level are compiled out altogether (meson -Dlog_max_level=N).
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 2
+#endif
+
+namespace logging
+{
+
+// A message is formatted on the calling thread into a buffer belonging to that thread, and
+// when it goes out of scope is queued on the thread's own lock-free ring. A background thread
+// writes them out, in the order they were made. Only LOG_ERROR waits for the write.
+class Message
+{
+public:
+	enum Mode
+	{
+		Queue,
+		Now
+	};
+
+	Message(Mode mode);
+	~Message();
+
+	std::ostream &Stream() { return *stream_; }
+
+private:
+	Mode mode_;
+	std::ostream *stream_;
+};
+
+// One per LOG_RATE_LIMITED call site.
+struct RateLimit
+{
+	std::atomic<int64_t> next_ns { 0 };
+	std::atomic<unsigned int> suppressed { 0 };
+};
+
+// Should this call site log now? If so, says how many messages it has suppressed since last time.
+bool Allow(RateLimit &limit, unsigned int interval_ms, unsigned int &suppressed);
+
+// Write out everything queued so far.
+void Flush();
+
+} // namespace logging
+
 #define LOG(level, text)                                                                                               \
 	do                                                                                                                 \
 	{                                                                                                                  \
-		if (RPiCamApp::GetVerbosity() >= level)                                                                     \
-			std::cerr << text << std::endl;                                                                            \
+		if ((level) <= LOG_MAX_LEVEL && RPiCamApp::GetVerbosity() >= (level))                                         \
+		{                                                                                                              \
+			logging::Message log_message_(logging::Message::Queue);                                                   \
+			log_message_.Stream() << text;                                                                             \
+		}                                                                                                              \
+	} while (0)
+
+#define LOG_ERROR(text)                                                                                                \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		logging::Message log_message_(logging::Message::Now);                                                         \
+		log_message_.Stream() << text;                                                                                 \
+	} while (0)
+
+// For messages that would otherwise repeat every frame: at most one per interval from this
+// call site, noting how many were left out.
+#define LOG_RATE_LIMITED(level, interval_ms, text)                                                                     \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if ((level) <= LOG_MAX_LEVEL && RPiCamApp::GetVerbosity() >= (level))                                         \
+		{                                                                                                              \
+			static logging::RateLimit log_limit_;                                                                      \
+			unsigned int log_suppressed_;                                                                              \
+			if (logging::Allow(log_limit_, interval_ms, log_suppressed_))                                              \
+			{                                                                                                          \
+				logging::Message log_message_(logging::Message::Queue);                                               \
+				log_message_.Stream() << text;                                                                         \
+				if (log_suppressed_)                                                                                   \
+					log_message_.Stream() << " (" << log_suppressed_ << " more suppressed)";                          \
+			}                                                                                                          \
+		}                                                                                                              \
 	} while (0)
-#define LOG_ERROR(text) std::cerr << text << std::endl
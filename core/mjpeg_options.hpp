@@ -54,20 +54,63 @@ struct MjpegOptions : public Options
 				"Set the output still width (0 = use default value)")
 			("image_height", value<unsigned int>(&stillOptions.height)->default_value(0),
 				"Set the output still height (0 = use default value)")
+			("lapse_path", value<std::string>(&lapse_output),
+				"Set the timelapse output file name, ending .mjpeg or .h264 to append every frame to one video")
+			("tl_interval", value<unsigned int>(&tl_interval)->default_value(300),
+				"Set the timelapse interval in 0.1s units")
 			("control_file", value<std::string>(&fifo), "The path to the commands FIFO")
+			("control_socket", value<std::string>(&control_socket),
+				"The path for a Unix socket taking acknowledged batches of commands (empty = none)")
 			("frame-divider", value<unsigned int>(&frameDivider)->default_value(1), // Add frameDivider option
             	"Set the frame divider for video recording (1 = no divider, higher values reduce frame rate)")
+			("preview_fps", value<float>(&preview_fps)->default_value(0),
+				"Limit the preview frame rate (0 = no limit)")
+			("preview_idle_timeout", value<unsigned int>(&preview_idle_timeout)->default_value(0),
+				"Drop to the idle preview rate when nobody has read the preview for this many seconds (0 = never)")
+			("preview_idle_fps", value<float>(&preview_idle_fps)->default_value(0.2),
+				"Preview frame rate while nobody is reading it (0 = stop updating)")
+			("video_buffer", value<unsigned int>(&video_buffer)->default_value(0),
+				"Keep encoding this many ms of video before recordings start, and include it in them (0 = off)")
 			// Break nopreview flag; the preview will not work in rpicam-mjpeg!
 			("nopreview,n", value<bool>(&nopreview)->default_value(true)->implicit_value(true),
 			"	**DO NOT USE** The preview window does not work for rpicam-mjpeg")
 			("status_file", value<std::string>(&status_output)->default_value("/dev/shm/mjpeg/status_mjpeg.txt"),
 				"Set the status output file name")
+			("status_block", value<std::string>(&status_block)->default_value("/dev/shm/mjpeg/status_mjpeg.shm"),
+				"Set the file the status and statistics are shared through, see rpicam-mjpeg-status (empty = none)")
 			("media_path", value<std::string>(&media_path)->implicit_value("/var/www/html/media"),
 				"Set the media path for storing RPi_Cam_Web_Interface thumbnails")
 			("thumb_gen", value<std::string>(&thumb_gen)->default_value("vit")->implicit_value("vit"),
 				"Enable thumbnail generation for v(ideo), i(mages) and t(imelapse). (vit = video, image, timelapse enabled)")
 			("motion_pipe", value<std::string>(&motion_output),
 				"The path to the Scheduler FIFO motion detection will output to.")
+			("motion_initframes", value<unsigned int>(&motion_initframes)->default_value(0),
+				"Number of frames to ignore when motion detection starts, while the image settles")
+			("motion_startframes", value<unsigned int>(&motion_startframes)->default_value(3),
+				"Number of frames in a row with motion needed to start recording")
+			("motion_stopframes", value<unsigned int>(&motion_stopframes)->default_value(50),
+				"Number of frames in a row without motion needed to stop recording")
+			("motion_clip", value<unsigned int>(&motion_clip)->default_value(0),
+				"Longest motion recording in seconds, continuing motion starts another (0 = no limit)")
+			("macros_path", value<std::string>(&macros_path),
+				"The directory holding the macro scripts, and those run by the sy command")
+			("start_img", value<std::string>(&start_img), "Macro run with the file name before saving an image")
+			("end_img", value<std::string>(&end_img), "Macro run with the file name once an image is saved")
+			("start_vid", value<std::string>(&start_vid), "Macro run with the file name when recording starts")
+			("end_vid", value<std::string>(&end_vid), "Macro run with the file name when recording ends")
+			("end_box", value<std::string>(&end_box),
+				"Macro run with the file name once a video is finished (there is no separate boxing step)")
+			("motion_event", value<std::string>(&motion_event), "Macro run with 1 or 0 when motion starts or stops")
+			("callback_timeout", value<unsigned int>(&callback_timeout)->default_value(30),
+				"Kill macros still running after this many seconds (0 = never)")
+			("sensor_region_x", value<unsigned int>(&sensor_region_x)->default_value(0),
+				"Left edge of the sensor region to use, in 1/65536ths of the sensor width")
+			("sensor_region_y", value<unsigned int>(&sensor_region_y)->default_value(0),
+				"Top edge of the sensor region to use, in 1/65536ths of the sensor height")
+			("sensor_region_w", value<unsigned int>(&sensor_region_w)->default_value(65536),
+				"Width of the sensor region to use, in 1/65536ths of the sensor width")
+			("sensor_region_h", value<unsigned int>(&sensor_region_h)->default_value(65536),
+				"Height of the sensor region to use, in 1/65536ths of the sensor height")
 			;
 		// clang-format on
 	}
@@ -153,112 +196,111 @@ struct MjpegOptions : public Options
 		Options::SetApp(app);
 	}
 
-	// TODO: Something better than this :)
-	void AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera()
+	// RaspiMJPEG gives contrast, saturation and sharpness in [-100, 100] with 0 meaning "normal",
+	// libcamera wants [0, 15.99] with 1 meaning "normal".
+	static float NormalizeRaspiMjpegScale(float value)
 	{
-		// Contrast
-		{
-			float normalized_contrast;
-			if (contrast < 0.0f) {
-				// If contrast is less than 0, map it to the range [0, 1]
-				normalized_contrast = (contrast + 100.0f) * (1.0f / 100.0f);
-			} else if (contrast == 0.0f) {
-				// If contrast is 0, set it to 1
-				normalized_contrast = 1.0f;
-			} else {
-				// If contrast is greater than 0, map it to the range [1.0f, 15.99f]
-				normalized_contrast = 1 + (contrast * 14.99f) / 100.0f;
-			}
-			contrast = std::clamp(normalized_contrast, 0.0f, 15.99f);
+		float normalized;
+		if (value < 0.0f) {
+			// If value is less than 0, map it to the range [0, 1]
+			normalized = (value + 100.0f) * (1.0f / 100.0f);
+		} else if (value == 0.0f) {
+			// If value is 0, set it to 1
+			normalized = 1.0f;
+		} else {
+			// If value is greater than 0, map it to the range [1.0f, 15.99f]
+			normalized = 1 + (value * 14.99f) / 100.0f;
 		}
+		return std::clamp(normalized, 0.0f, 15.99f);
+	}
 
-		// Brightness
-		{
-			LOG(1, "Adjusting brightness, was " << brightness);
-			// Clamp brightness to the valid range [0, 100]
-			brightness = std::max(0.0f, std::min(brightness, 100.0f));
-
-			// Convert brightness to the range [-1.0f, 1.0f]
-			float normalized_brightness = (brightness / 50.0f) - 1.0f;
-			brightness = normalized_brightness;
-			LOG(1, "Adjusted brightness, is " << brightness);
-		}
+	// RaspiMJPEG brightness is [0, 100], libcamera wants [-1.0, 1.0].
+	static float NormalizeRaspiMjpegBrightness(float value)
+	{
+		// Clamp brightness to the valid range [0, 100]
+		value = std::max(0.0f, std::min(value, 100.0f));
+		return (value / 50.0f) - 1.0f;
+	}
 
-		ev = std::max(-10.0f, std::min(ev, 10.0f));
+	static float NormalizeRaspiMjpegEv(float value) { return std::max(-10.0f, std::min(value, 10.0f)); }
 
-		// AWB Gain
-		{
-			awb_gain_r /= 100;
-			awb_gain_b /= 100; 
-			awbgains = std::to_string(awb_gain_r) + "," + std::to_string(awb_gain_b);
+	// RaspiMJPEG gives ISO, according to the Raspicam-app github issue #349 iso/100 = gain
+	static float NormalizeRaspiMjpegGain(float value) { return std::max(100.0f, std::min(value, 2000.0f)) / 100; }
+
+	// RaspiMJPEG colour gains are given in hundredths.
+	static float NormalizeRaspiMjpegAwbGain(float value) { return value / 100; }
+
+	static int NormalizeRaspiMjpegQuality(float value)
+	{
+		// Clamp quality to the valid range [0, 100]
+		value = std::max(0.0f, std::min(value, 100.0f));
+		float normalized;
+		if (value <= 10.0f) {
+			// Map quality from [0, 10] to [60, 85]
+			normalized = 60.0f + (value * 2.5f);
+		} else {
+			// Map quality from [10, 100] to [85, 100]
+			normalized = 85.0f + ((value - 10.0f) * (15.0f / 90.0f));
 		}
+		return std::clamp(normalized, 60.0f, 100.0f);
+	}
+
+	// Clamp bitrate to the valid range [0, 25000000]
+	static uint64_t NormalizeRaspiMjpegBitrate(uint64_t bps) { return std::min<uint64_t>(bps, 25000000ul); }
 
-		// Gain
+	// RaspiMJPEG gives the sensor region in 1/65536ths, libcamera's roi is in fractions of the
+	// sensor with a zero size meaning all of it.
+	void SetRaspiMjpegRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+	{
+		x = std::min(x, 65535u);
+		y = std::min(y, 65535u);
+		w = std::min(w, 65536 - x);
+		h = std::min(h, 65536 - y);
+		if (w == 0 || h == 0)
+			throw std::runtime_error("empty sensor region");
+
+		if (x == 0 && y == 0 && w == 65536 && h == 65536)
+			roi_x = roi_y = roi_width = roi_height = 0;
+		else
 		{
-			gain = std::max(100.0f, std::min(gain, 2000.0f));
-			//according to the Raspicam-app github issue #349 iso/100 = gain
-			gain /= 100;
+			roi_x = x / 65536.0f;
+			roi_y = y / 65536.0f;
+			roi_width = w / 65536.0f;
+			roi_height = h / 65536.0f;
 		}
+		roi = std::to_string(roi_x) + "," + std::to_string(roi_y) + "," + std::to_string(roi_width) + "," +
+			  std::to_string(roi_height);
+	}
 
-		// Saturation
-		{
-			float normalized_saturation;
-			if (saturation < 0.0f) {
-				// If saturation is less than 0, map it to the range [0, 1]
-				normalized_saturation = (saturation + 100.0f) * (1.0f / 100.0f);
-			} else if (saturation == 0.0f) {
-				// If saturation is 0, set it to 1
-				normalized_saturation = 1.0f;
-			} else {
-				// If saturation is greater than 0, map it to the range [1.0f, 15.99f]
-				normalized_saturation = 1 + (saturation * 14.99f) / 100.0f;
-			}
+	// TODO: Something better than this :)
+	// NOTE: Only call this once on freshly parsed RaspiMJPEG values; the FIFO handlers
+	// normalize just the value they change with the helpers above.
+	void AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera()
+	{
+		contrast = NormalizeRaspiMjpegScale(contrast);
 
-			saturation = std::clamp(normalized_saturation, 0.0f, 15.99f);
-		}
+		LOG(1, "Adjusting brightness, was " << brightness);
+		brightness = NormalizeRaspiMjpegBrightness(brightness);
+		LOG(1, "Adjusted brightness, is " << brightness);
 
-		// Still Quality
-		{
-			// Clamp quality to the valid range [0, 100]
-			stillOptions.quality = std::max(0.0f, std::min((float)stillOptions.quality, 100.0f));
-			float normalized_quality;
-			if (stillOptions.quality <= 10.0f) {
-				// Map quality from [0, 10] to [60, 85]
-				normalized_quality = 60.0f + (stillOptions.quality * 2.5f);
-			} else {
-				// Map quality from [10, 100] to [85, 100]
-				normalized_quality = 85.0f + ((stillOptions.quality - 10.0f) * (15.0f / 90.0f));
-			}
-			stillOptions.quality = std::clamp(normalized_quality, 60.0f, 100.0f);
-		}
+		ev = NormalizeRaspiMjpegEv(ev);
 
-		// Video Bitrate
+		// AWB Gain
 		{
-			// Ensure bitrate is non-negative
-			auto bitrate = videoOptions.bitrate.bps();
-		
-			// Clamp bitrate to the valid range [0, 25000000]
-			bitrate = std::min(bitrate, 25000000ul);
-			videoOptions.bitrate.set(std::to_string(bitrate) + "bps");
+			awb_gain_r = NormalizeRaspiMjpegAwbGain(awb_gain_r);
+			awb_gain_b = NormalizeRaspiMjpegAwbGain(awb_gain_b);
+			awbgains = std::to_string(awb_gain_r) + "," + std::to_string(awb_gain_b);
 		}
 
-		// Sharpness
-		{
-
-			float normalized_sharpness;
-			if (sharpness < 0.0f) {
-				// If sharpness is less than 0, map it to the range [0, 1]
-				normalized_sharpness = (sharpness + 100.0f) * (1.0f / 100.0f);
-			} else if (sharpness == 0.0f) {
-				// If sharpness is 0, set it to 1
-				normalized_sharpness = 1.0f;
-			} else {
-				// If sharpness is greater than 0, map it to the range [1.0f, 15.99f]
-				normalized_sharpness = 1 + (sharpness * 14.99f) / 100.0f;
-			}
+		gain = NormalizeRaspiMjpegGain(gain);
+		saturation = NormalizeRaspiMjpegScale(saturation);
+		stillOptions.quality = NormalizeRaspiMjpegQuality(stillOptions.quality);
+		videoOptions.bitrate.set(std::to_string(NormalizeRaspiMjpegBitrate(videoOptions.bitrate.bps())) + "bps");
+		sharpness = NormalizeRaspiMjpegScale(sharpness);
 
-			sharpness = std::clamp(normalized_sharpness, 0.0f, 15.99f);
-		}
+		// Leave any --roi alone unless a region was actually given.
+		if (sensor_region_x || sensor_region_y || sensor_region_w < 65536 || sensor_region_h < 65536)
+			SetRaspiMjpegRegion(sensor_region_x, sensor_region_y, sensor_region_w, sensor_region_h);
 	}
 
 	void AdjustValuesBeforeStandardAdjustments() override
@@ -266,12 +308,36 @@ struct MjpegOptions : public Options
 		AdjustRaspiMjpegOptionsToThingsThatActuallyWorkWithLibcamera();
 	}
 	unsigned int frameDivider;  // Declare frameDivider here
+	float preview_fps;
+	unsigned int preview_idle_timeout;
+	float preview_idle_fps;
+	unsigned int video_buffer;
+	unsigned int tl_interval;
+	unsigned int motion_initframes;
+	unsigned int motion_startframes;
+	unsigned int motion_stopframes;
+	unsigned int motion_clip;
+	unsigned int callback_timeout;
+	unsigned int sensor_region_x;
+	unsigned int sensor_region_y;
+	unsigned int sensor_region_w;
+	unsigned int sensor_region_h;
 
 	std::string video_output;
+	std::string lapse_output;
 	std::string fifo;
+	std::string control_socket;
 	std::string status_output;
+	std::string status_block;
 	std::string media_path;
 	std::string thumb_gen;
+	std::string macros_path;
+	std::string start_img;
+	std::string end_img;
+	std::string start_vid;
+	std::string end_vid;
+	std::string end_box;
+	std::string motion_event;
 
 	virtual void Print() const override
 	{
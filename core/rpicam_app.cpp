@@ -1002,11 +1002,13 @@ void RPiCamApp::StopCamera()
 	// called to delete it later, but we need to know not to try and re-queue it.
 	completed_requests_.clear();
 
-	msg_queue_.Clear();
+	// Pending commands are not camera messages and must survive a restart.
+	msg_queue_.Clear([](Msg const &msg) { return msg.type == MsgType::Command; });
 
 	requests_.clear();
 
 	controls_.clear(); // no need for mutex here
+	control_requests_.clear();
 
 	if (!options_->help)
 		LOG(2, "Camera stopped!");
@@ -1017,6 +1019,11 @@ RPiCamApp::Msg RPiCamApp::Wait()
 	return msg_queue_.Wait();
 }
 
+std::optional<RPiCamApp::Msg> RPiCamApp::Wait(std::chrono::milliseconds timeout)
+{
+	return msg_queue_.Wait(timeout);
+}
+
 void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 {
 	BufferMap buffers(std::move(completed_request->buffers));
@@ -1066,6 +1073,8 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
+		if (!controls_.empty())
+			control_requests_.insert(request);
 		request->controls() = std::move(controls_);
 	}
 
@@ -1157,6 +1166,8 @@ StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 	info.width = cfg.size.width;
 	info.height = cfg.size.height;
 	info.stride = cfg.stride;
+	// Not counting the buffers set aside for requests the application holds on to.
+	info.buffer_count = cfg.bufferCount > held_requests_ ? cfg.bufferCount - held_requests_ : 0;
 	info.pixel_format = cfg.pixelFormat;
 	info.colour_space = cfg.colorSpace;
 	return info;
@@ -1167,7 +1178,10 @@ void RPiCamApp::setupCapture()
 	// First finish setting up the configuration.
 
 	for (auto &config : *configuration_)
+	{
 		config.stride = 0;
+		config.bufferCount += held_requests_;
+	}
 	CameraConfiguration::Status validation = configuration_->validate();
 	if (validation == CameraConfiguration::Invalid)
 		throw std::runtime_error("failed to valid stream configurations");
@@ -1281,7 +1295,14 @@ void RPiCamApp::requestComplete(Request *request)
 			throw std::runtime_error("failed to sync dma buf on request complete");
 	}
 
+	bool controls_applied;
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		controls_applied = control_requests_.erase(request) > 0;
+	}
+
 	CompletedRequest *r = new CompletedRequest(sequence_++, request);
+	r->controls_applied = controls_applied;
 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
@@ -9,10 +9,12 @@
 
 #include <sys/mman.h>
 
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
@@ -67,9 +69,17 @@ public:
 	{
 		RequestComplete,
 		Timeout,
-		Quit
+		Quit,
+		// An external command (a std::string payload) for the application to handle, or a
+		// CommandBatch to be handled and acknowledged together.
+		Command
 	};
-	typedef std::variant<CompletedRequestPtr> MsgPayload;
+	struct CommandBatch
+	{
+		uint64_t id;
+		std::vector<std::string> commands;
+	};
+	typedef std::variant<CompletedRequestPtr, std::string, CommandBatch> MsgPayload;
 	struct Msg
 	{
 		Msg(MsgType const &t) : type(t) {}
@@ -137,6 +147,11 @@ public:
 	void OpenCamera();
 	void CloseCamera();
 
+	// Requests the application keeps hold of while the camera runs (rather than only while it
+	// works on them). Each stream gets this many buffers on top of what it is configured with,
+	// so the camera never goes short; set before configuring.
+	void SetHeldRequests(unsigned int count) { held_requests_ = count; }
+
 	void ConfigureViewfinder();
 	void ConfigureStill(unsigned int flags = FLAG_STILL_NONE);
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
@@ -151,6 +166,8 @@ public:
 	void StopCamera();
 
 	Msg Wait();
+	// As Wait(), but gives up and returns nothing if no message arrives within the timeout.
+	std::optional<Msg> Wait(std::chrono::milliseconds timeout);
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -175,6 +192,10 @@ public:
 	{
 		return camera_->properties();
 	}
+	const libcamera::ControlInfoMap &GetCameraControls() const
+	{
+		return camera_->controls();
+	}
 
 	static unsigned int verbosity;
 	static unsigned int GetVerbosity() { return verbosity; }
@@ -218,11 +239,34 @@ private:
 			queue_.pop();
 			return msg;
 		}
+		template <typename Rep, typename Period>
+		std::optional<T> Wait(std::chrono::duration<Rep, Period> const &timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (!cond_.wait_for(lock, timeout, [this] { return !queue_.empty(); }))
+				return std::nullopt;
+			T msg = std::move(queue_.front());
+			queue_.pop();
+			return msg;
+		}
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_ = {};
 		}
+		// Clear everything except the messages for which keep returns true.
+		template <typename F>
+		void Clear(F &&keep)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			std::queue<T> kept;
+			for (; !queue_.empty(); queue_.pop())
+			{
+				if (keep(queue_.front()))
+					kept.push(std::move(queue_.front()));
+			}
+			queue_ = std::move(kept);
+		}
 
 	private:
 		std::queue<T> queue_;
@@ -285,9 +329,11 @@ private:
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	std::set<Request *> control_requests_;
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
+	unsigned int held_requests_ = 0;
 	PostProcessor post_processor_;
 	libcamera::PixelFormat lores_format_ = libcamera::formats::YUV420;
 };
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <algorithm>
+#include <deque>
+
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
@@ -47,7 +50,7 @@ public:
 		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
@@ -68,23 +71,24 @@ protected:
 private:
 	void encodeBufferDone(void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		// If non-NULL, mem indicates which buffer has been completed, which need not be the
+		// oldest if the encoder dropped frames. Otherwise everything is done in order.
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
+			auto it = encode_buffer_queue_.begin();
+			if (mem)
+				it = std::find_if(encode_buffer_queue_.begin(), encode_buffer_queue_.end(),
+								  [mem](auto const &item) { return item.first == mem; });
+			if (it == encode_buffer_queue_.end())
 				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
+			CompletedRequestPtr &completed_request = it->second;
 			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
 				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			encode_buffer_queue_.erase(it); // drop shared_ptr reference
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::deque<std::pair<void *, CompletedRequestPtr>> encode_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
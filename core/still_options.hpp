@@ -32,6 +32,9 @@ struct StillOptions : public Options
 			 "Use system timestamps for output file names")
 			("restart", value<unsigned int>(&restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("jpeg-bands", value<unsigned int>(&jpeg_bands)->default_value(1),
+			 "Encode JPEGs in this many bands at once, joined by restart markers (0 = one per core, 1 = off). "
+			 "Replaces the restart interval.")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -61,6 +64,7 @@ struct StillOptions : public Options
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	unsigned int jpeg_bands;
 	bool keypress;
 	bool signal;
 	std::string thumb;
@@ -112,6 +116,7 @@ struct StillOptions : public Options
 		std::cerr << "    quality: " << quality << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
+		std::cerr << "    jpeg-bands: " << jpeg_bands << std::endl;
 		std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
 		std::cerr << "    datetime: " << datetime << std::endl;
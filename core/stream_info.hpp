@@ -13,10 +13,13 @@
 
 struct StreamInfo
 {
-	StreamInfo() : width(0), height(0), stride(0) {}
+	StreamInfo() : width(0), height(0), stride(0), buffer_count(0) {}
 	unsigned int width;
 	unsigned int height;
 	unsigned int stride;
+	// Buffers allocated for the stream, less any set aside for requests the app holds on to
+	// (0 if not known).
+	unsigned int buffer_count;
 	libcamera::PixelFormat pixel_format;
 	std::optional<libcamera::ColorSpace> colour_space;
 };
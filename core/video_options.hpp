@@ -108,6 +108,16 @@ struct VideoOptions : public Options
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("encoder-threads", value<unsigned int>(&encoder_threads)->default_value(0),
+			 "Set the number of MJPEG encoding threads, 0 for one per core (mjpeg only)")
+			("encoder-queue", value<unsigned int>(&encoder_queue)->default_value(16),
+			 "Set the most frames the MJPEG encoder may hold at once, up to 16 and one fewer than the camera "
+			 "has buffers (mjpeg only)")
+			("encoder-drop", value<std::string>(&encoder_drop)->default_value("block"),
+			 "What to do with a frame when the MJPEG encoder's queue is full: block, newest (drop it) or oldest "
+			 "(drop the oldest not being encoded) (mjpeg only)")
+			("jpeg-bands", value<unsigned int>(&jpeg_bands)->default_value(1),
+			 "Encode each frame in this many bands at once, joined by restart markers (0 = one per core, 1 = off, mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
 			 "Listen for an incoming client network connection before sending data to the client")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
@@ -185,6 +195,10 @@ struct VideoOptions : public Options
 	TimeVal<std::chrono::microseconds> av_sync;
 	std::string save_pts;
 	int quality;
+	unsigned int encoder_threads;
+	unsigned int encoder_queue;
+	std::string encoder_drop;
+	unsigned int jpeg_bands;
 	bool listen;
 	bool keypress;
 	bool signal;
@@ -257,6 +271,10 @@ struct VideoOptions : public Options
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    encoder-threads (for MJPEG): " << encoder_threads << std::endl;
+		std::cerr << "    encoder-queue (for MJPEG): " << encoder_queue << std::endl;
+		std::cerr << "    encoder-drop (for MJPEG): " << encoder_drop << std::endl;
+		std::cerr << "    jpeg-bands (for MJPEG): " << jpeg_bands << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
@@ -60,6 +60,6 @@ Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 		return libav_codec_select(options, info);
 #endif
 	else if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
-		return new MjpegEncoder(options);
+		return new MjpegEncoder(options, info);
 	throw std::runtime_error("Unrecognised codec " + options->codec);
 }
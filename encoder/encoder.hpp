@@ -23,7 +23,10 @@ public:
 	Encoder(VideoOptions const *options) : options_(options) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. The buffer
+	// must be kept until then. The callback gets the mem pointer the buffer was given
+	// with, or nullptr meaning the oldest (encoders that never drop frames finish with
+	// them in order). It is called exactly once for every EncodeBuffer call.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
@@ -32,6 +35,13 @@ public:
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Change the target bitrate of a running encoder. Returns false if the encoder
+	// cannot do this, in which case the new value only applies to the next encoder.
+	virtual bool SetBitrate(uint64_t bitrate_bps) { return false; }
+	// Point an encoder that hasn't encoded anything yet at a different output file, so that
+	// one can be created ahead of time. Only matters for encoders that write their own output
+	// rather than passing it to the output ready callback. Returns false if it's too late.
+	virtual bool Retarget(std::string const &output) { return true; }
 
 protected:
 	InputDoneCallback input_done_callback_;
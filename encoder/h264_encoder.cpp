@@ -272,6 +272,20 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::SetBitrate(uint64_t bitrate_bps)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate_bps;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "Failed to change H264Encoder bitrate to " << bitrate_bps);
+		return false;
+	}
+	LOG(2, "H264Encoder bitrate changed to " << bitrate_bps);
+	return true;
+}
+
 void H264Encoder::pollThread()
 {
 	while (true)
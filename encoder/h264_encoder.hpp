@@ -21,6 +21,8 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Change the bitrate while encoding.
+	bool SetBitrate(uint64_t bitrate_bps) override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
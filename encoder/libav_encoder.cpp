@@ -329,7 +329,7 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 }
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
+	: Encoder(options), output_ready_(false), pending_bitrate_(0), abort_video_(false), abort_audio_(false), video_start_ts_(0),
 	  audio_samples_(0), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->output)
 {
 	if (options->circular || options->segment || !options->save_pts.empty() || options->split)
@@ -439,6 +439,24 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	video_cv_.notify_all();
 }
 
+bool LibAvEncoder::SetBitrate(uint64_t bitrate_bps)
+{
+	if (!bitrate_bps)
+		return false;
+	pending_bitrate_ = bitrate_bps;
+	return true;
+}
+
+bool LibAvEncoder::Retarget(std::string const &output)
+{
+	// The output is opened on the first encoded packet, and the container format was
+	// picked from the original name, so this had better have the same extension.
+	if (output_ready_ || video_start_ts_)
+		return false;
+	output_file_ = output;
+	return true;
+}
+
 void LibAvEncoder::initOutput()
 {
 	int ret;
@@ -474,7 +492,7 @@ void LibAvEncoder::initOutput()
 
 void LibAvEncoder::deinitOutput()
 {
-	if (!out_fmt_ctx_)
+	if (!out_fmt_ctx_ || !output_ready_)
 		return;
 
 	av_write_trailer(out_fmt_ctx_);
@@ -499,6 +517,16 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 		else if (ret < 0)
 			throw std::runtime_error("libav: error receiving packet: " + std::to_string(ret));
 
+		// With no output file, hand the (raw H.264) video packets to the output ready callback
+		// like the other encoders do.
+		if (output_file_.empty() && output_ready_callback_)
+		{
+			if (stream_id == Video)
+				output_ready_callback_(pkt->data, pkt->size, pkt->pts, pkt->flags & AV_PKT_FLAG_KEY);
+			av_packet_unref(pkt);
+			continue;
+		}
+
 		// Initialise the ouput mux on the first received video packet, as we may need
 		// to copy global header data from the encoder.
 		if (stream_id == Video && !output_ready_)
@@ -568,6 +596,11 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		// Encoders such as libx264 reconfigure themselves when they see bit_rate change.
+		uint64_t bitrate = pending_bitrate_.exchange(0);
+		if (bitrate)
+			codec_ctx_[Video]->bit_rate = bitrate;
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
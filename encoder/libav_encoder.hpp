@@ -38,6 +38,10 @@ public:
 	~LibAvEncoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Change the bitrate while encoding (picked up before the next frame is sent).
+	bool SetBitrate(uint64_t bitrate_bps) override;
+	// Change the output file, if it hasn't been opened yet.
+	bool Retarget(std::string const &output) override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -54,6 +58,7 @@ private:
 	static void releaseBuffer(void *opaque, uint8_t *data);
 
 	std::atomic<bool> output_ready_;
+	std::atomic<uint64_t> pending_bitrate_;
 	bool abort_video_;
 	bool abort_audio_;
 	uint64_t video_start_ts_;
@@ -5,134 +5,273 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
 
-#include <jpeglib.h>
+#include "image/image.hpp"
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+MjpegEncoder::BufferPool::~BufferPool()
+{
+	for (Buffer &buffer : free_)
+		free(buffer.mem);
+}
+
+MjpegEncoder::BufferPool::Buffer MjpegEncoder::BufferPool::Get(size_t min_size)
+{
+	Buffer buffer = { nullptr, 0 };
+	size_t size;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		size = size_hint_ ? size_hint_ : min_size;
+		if (!free_.empty())
+		{
+			buffer = free_.back();
+			free_.pop_back();
+		}
+	}
+
+	// Only reallocate if frames have got bigger, so this settles once the pool is full.
+	if (buffer.size < size)
+	{
+		free(buffer.mem);
+		buffer.mem = (uint8_t *)malloc(size);
+		if (!buffer.mem)
+			throw std::runtime_error("failed to allocate mjpeg output buffer");
+		buffer.size = size;
+		LOG(2, "MjpegEncoder: allocated " << size << " byte output buffer");
+	}
+	return buffer;
+}
+
+void MjpegEncoder::BufferPool::Put(Buffer buffer, size_t bytes_used)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	// Leave some headroom over the biggest recent frame, rounded up to whole pages.
+	recent_[recent_index_++ % recent_.size()] = bytes_used;
+	size_hint_ = (*std::max_element(recent_.begin(), recent_.end()) * 5 / 4 + 4095) & ~(size_t)4095;
+
+	// Don't hang on to a lot more memory than we need if the frames have got smaller.
+	if (buffer.size > 4 * size_hint_)
+		free(buffer.mem);
+	else
+		free_.push_back(buffer);
+}
+
+void MjpegEncoder::Doorbell::Ring(bool all)
+{
+	// Pairs with the sleepers++ in Wait: either we see the sleeper, or it sees our change.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleepers.load() == 0)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (all)
+		cond_var.notify_all();
+	else
+		cond_var.notify_one();
+}
+
+MjpegEncoder::EncodeRing::EncodeRing() : head_(0), tail_(0)
+{
+	for (unsigned int i = 0; i < RING_SIZE; i++)
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool MjpegEncoder::EncodeRing::Push(EncodeItem const &item)
+{
+	uint64_t pos = head_.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Cell &cell = cells_[pos % RING_SIZE];
+		int64_t diff = (int64_t)cell.sequence.load(std::memory_order_acquire) - (int64_t)pos;
+		if (diff == 0)
+		{
+			// Our turn to fill this cell, if nobody else claims it first.
+			if (head_.compare_exchange_weak(pos, pos + 1))
+			{
+				cell.item = item;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false; // still holding last lap's item, so the ring is full
+		else
+			pos = head_.load(std::memory_order_relaxed);
+	}
+}
+
+bool MjpegEncoder::EncodeRing::Pop(EncodeItem &item)
+{
+	uint64_t pos = tail_.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Cell &cell = cells_[pos % RING_SIZE];
+		int64_t diff = (int64_t)cell.sequence.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+		if (diff == 0)
+		{
+			if (tail_.compare_exchange_weak(pos, pos + 1))
+			{
+				item = cell.item;
+				cell.sequence.store(pos + RING_SIZE, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false; // not filled yet, so the ring is empty
+		else
+			pos = tail_.load(std::memory_order_relaxed);
+	}
+}
 
-MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+MjpegEncoder::MjpegEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), in_flight_(0), dropped_(0),
+	  dropped_reported_(0), output_index_(0)
 {
+	if (options->encoder_drop == "block")
+		drop_policy_ = DropPolicy::Block;
+	else if (options->encoder_drop == "newest")
+		drop_policy_ = DropPolicy::DropNewest;
+	else if (options->encoder_drop == "oldest")
+		drop_policy_ = DropPolicy::DropOldest;
+	else
+		throw std::runtime_error("unrecognised encoder drop policy " + options->encoder_drop);
+	// Leave room in the ring for frames dropped from the middle of the queue. Nor can we hold on to
+	// every one of the camera's buffers, or it stalls before we ever find the queue full.
+	max_in_flight_ = std::clamp(options->encoder_queue, 1u, RING_SIZE / 2);
+	if (info.buffer_count > 1)
+		max_in_flight_ = std::min(max_in_flight_, info.buffer_count - 1);
+
+	// One thread per core unless told otherwise; an idle one costs nothing. When every frame is
+	// spread across the cores anyway, two is enough to keep them busy between frames.
+	unsigned int num_threads = options->encoder_threads;
+	if (!num_threads && options->jpeg_bands != 1)
+		num_threads = 2;
+	else if (!num_threads)
+		num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	encode_us_.reserve(LATENCY_WINDOW);
+	latency_us_.reserve(LATENCY_WINDOW);
+
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_threads_.emplace_back(&MjpegEncoder::encodeThread, this, i);
+	LOG(2, "Opened MjpegEncoder with " << num_threads << " threads, holding up to " << max_in_flight_ << " frames");
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
 	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	encode_bell_.Ring(true);
+	for (auto &thread : encode_threads_)
+		thread.join();
 	abortOutput_ = true;
+	output_bell_.Ring();
 	output_thread_.join();
-	LOG(2, "MjpegEncoder closed");
+	reportLatency();
+	LOG(2, "MjpegEncoder closed, " << dropped_ << " frames dropped");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
-}
-
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
-{
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
-
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	if (in_flight_.load() >= max_in_flight_ && drop_policy_ != DropPolicy::Block)
 	{
-		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+		// If every frame we have is already being encoded, the newest has to go instead.
+		if (drop_policy_ == DropPolicy::DropNewest || !dropOldest())
+		{
+			dropped_++;
+			input_done_callback_(mem);
+			return;
+		}
+	}
 
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
+	// Every frame, even a dropped one, has its own output slot until the output thread is past it,
+	// so we may still have to wait for the oldest to go.
+	if (!hasRoom())
+	{
+		LOG(2, "MjpegEncoder: " << in_flight_ << " frames in flight, waiting");
+		room_bell_.Wait([this]() { return hasRoom(); });
 	}
 
-	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	in_flight_++;
+	EncodeItem item = { mem, info, timestamp_us, index_++, Clock::now() };
+	// Can't fail, there's a cell for every frame in flight.
+	encode_ring_.Push(item);
+	encode_bell_.Ring();
+}
+
+bool MjpegEncoder::hasRoom() const
+{
+	return in_flight_.load() < max_in_flight_ && index_ - output_index_.load() < RING_SIZE;
+}
+
+bool MjpegEncoder::dropOldest()
+{
+	EncodeItem item;
+	if (!encode_ring_.Pop(item))
+		return false;
+
+	// The output thread steps over it when it gets there, but the application can have it now.
+	OutputSlot &slot = output_ring_[item.index % RING_SIZE];
+	slot.input = item.mem;
+	slot.buffer = { nullptr, 0 };
+	slot.ready.store(true);
+	output_bell_.Ring();
+
+	dropped_++;
+	input_done_callback_(item.mem);
+	in_flight_--;
+	return true;
+}
+
+void MjpegEncoder::encodeJPEG(EncodeItem &item, BufferPool::Buffer &buffer, size_t &buffer_len)
+{
+	// Frames rarely come to more than a byte a pixel, and the buffer will grow if one does.
+	buffer = buffer_pool_.Get(item.info.width * item.info.height);
+	uint8_t const *input = (uint8_t *)item.mem;
+	if (options_->jpeg_bands != 1)
+		buffer_len =
+			YUV420_to_JPEG_bands(input, item.info, options_->quality, options_->jpeg_bands, buffer.mem, buffer.size);
+	else
+#if TURBOJPEG_PRESENT
+		buffer_len = YUV420_to_JPEG_turbo(input, item.info, options_->quality, buffer.mem, buffer.size);
+#else
+		buffer_len = YUV420_to_JPEG_libjpeg(input, item.info, options_->quality, 0, buffer.mem, buffer.size);
+#endif
 }
 
 void MjpegEncoder::encodeThread(int num)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
 
 	EncodeItem encode_item;
 	while (true)
 	{
+		if (!encode_ring_.Pop(encode_item))
 		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			// All the frames are queued before we're told to stop, so empty means done.
+			if (abortEncode_)
 			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
+				if (frames)
+					LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
+									 << "ms");
+				return;
 			}
+			encode_bell_.Wait([this]() { return !encode_ring_.Empty() || abortEncode_; });
+			continue;
 		}
 
 		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
+		BufferPool::Buffer buffer;
 		size_t buffer_len = 0;
-		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
-		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+		auto start_time = Clock::now();
+		encodeJPEG(encode_item, buffer, buffer_len);
+		Clock::duration this_time = Clock::now() - start_time;
+		encode_time += this_time;
 		frames++;
 		// Don't return buffers until the output thread as that's where they're
 		// in order again.
@@ -140,54 +279,69 @@ void MjpegEncoder::encodeThread(int num)
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		OutputSlot &slot = output_ring_[encode_item.index % RING_SIZE];
+		slot.input = encode_item.mem;
+		slot.buffer = buffer;
+		slot.bytes_used = buffer_len;
+		slot.timestamp_us = encode_item.timestamp_us;
+		slot.queued = encode_item.queued;
+		slot.encode_time = this_time;
+		slot.ready.store(true);
+		output_bell_.Ring();
 	}
 }
 
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
 	uint64_t index = 0;
 	while (true)
 	{
+		// The encoders are done before we're told to stop, so a slot that isn't ready then never
+		// will be, and every frame has had its callbacks.
+		OutputSlot &slot = output_ring_[index % RING_SIZE];
+		output_bell_.Wait([this, &slot]() { return slot.ready.load() || abortOutput_; });
+		if (!slot.ready.load())
+			return;
+
+		// A dropped frame has already been handed back.
+		if (slot.buffer.mem)
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
-			}
+			input_done_callback_(slot.input);
+			in_flight_--;
+
+			// The application is done with the buffer once this returns, so it can go straight back.
+			output_ready_callback_(slot.buffer.mem, slot.bytes_used, slot.timestamp_us, true);
+			buffer_pool_.Put(slot.buffer, slot.bytes_used);
+
+			using namespace std::chrono;
+			encode_us_.push_back(duration_cast<microseconds>(slot.encode_time).count());
+			latency_us_.push_back(duration_cast<microseconds>(Clock::now() - slot.queued).count());
+			if (latency_us_.size() == LATENCY_WINDOW)
+				reportLatency();
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		slot.ready.store(false, std::memory_order_relaxed);
+		output_index_.store(++index);
+		room_bell_.Ring();
 	}
 }
+
+void MjpegEncoder::reportLatency()
+{
+	if (latency_us_.empty())
+		return;
+
+	auto percentile = [](std::vector<uint32_t> &samples, unsigned int p) {
+		auto nth = samples.begin() + (samples.size() - 1) * p / 100;
+		std::nth_element(samples.begin(), nth, samples.end());
+		return *nth;
+	};
+	uint64_t dropped = dropped_.load();
+	LOG(2, "MjpegEncoder: " << latency_us_.size() << " frames, " << dropped - dropped_reported_
+							<< " dropped, encode p50 " << percentile(encode_us_, 50) << "us p99 "
+							<< percentile(encode_us_, 99) << "us, end-to-end p50 " << percentile(latency_us_, 50)
+							<< "us p99 " << percentile(latency_us_, 99) << "us");
+	dropped_reported_ = dropped;
+	encode_us_.clear();
+	latency_us_.clear();
+}
@@ -7,38 +7,85 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
-struct jpeg_compress_struct;
-
 class MjpegEncoder : public Encoder
 {
 public:
-	MjpegEncoder(VideoOptions const *options);
+	MjpegEncoder(VideoOptions const *options, StreamInfo const &info);
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	typedef std::chrono::steady_clock Clock;
 
-	// These threads do the actual encoding.
-	void encodeThread(int num);
+	// Most frames that can be waiting to be output at once, including dropped ones that haven't
+	// been passed yet, a power of two. EncodeBuffer waits for the oldest to go rather than go over.
+	static constexpr unsigned int RING_SIZE = 32;
 
-	// Handle the output buffers in another thread so as not to block the encoders. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
+	// What EncodeBuffer does when the application already has max_in_flight_ frames with us.
+	enum class DropPolicy
+	{
+		Block,
+		DropNewest,
+		DropOldest
+	};
+	// Report the latency percentiles after this many frames.
+	static constexpr unsigned int LATENCY_WINDOW = 300;
 
-	bool abortEncode_;
-	bool abortOutput_;
-	uint64_t index_;
+	// Lets a thread sleep until another changes some atomic state, without the other having
+	// to take a lock unless somebody really is asleep.
+	struct Doorbell
+	{
+		template <typename Pred>
+		void Wait(Pred pred)
+		{
+			if (pred())
+				return;
+			std::unique_lock<std::mutex> lock(mutex);
+			sleepers++;
+			cond_var.wait(lock, pred);
+			sleepers--;
+		}
+		void Ring(bool all = false);
+
+		std::mutex mutex;
+		std::condition_variable cond_var;
+		std::atomic<unsigned int> sleepers { 0 };
+	};
+
+	// Encoded frames are written straight into buffers from here and come back once they've been
+	// output, so after the first few frames the output buffers are no longer allocated. libjpeg
+	// (and TurboJPEG) still allocate and free their working memory for every image.
+	class BufferPool
+	{
+	public:
+		struct Buffer
+		{
+			uint8_t *mem;
+			size_t size;
+		};
+		~BufferPool();
+		// A buffer at least as big as recent frames have needed, or min_size if we don't know yet.
+		Buffer Get(size_t min_size);
+		void Put(Buffer buffer, size_t bytes_used);
+
+	private:
+		std::mutex mutex_;
+		std::vector<Buffer> free_;
+		std::array<size_t, 16> recent_ {};
+		unsigned int recent_index_ = 0;
+		size_t size_hint_ = 0;
+	};
 
 	struct EncodeItem
 	{
@@ -46,22 +93,84 @@ private:
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		Clock::time_point queued;
 	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
 
-	struct OutputItem
+	// Bounded lock-free queue for any number of producers and consumers. Each cell's sequence
+	// number says whether it is waiting to be filled or emptied for the current lap of the ring.
+	class EncodeRing
 	{
-		void *mem;
+	public:
+		EncodeRing();
+		bool Push(EncodeItem const &item);
+		bool Pop(EncodeItem &item);
+		bool Empty() const { return tail_.load() == head_.load(); }
+
+	private:
+		struct Cell
+		{
+			std::atomic<uint64_t> sequence;
+			EncodeItem item;
+		};
+		std::array<Cell, RING_SIZE> cells_;
+		alignas(64) std::atomic<uint64_t> head_;
+		alignas(64) std::atomic<uint64_t> tail_;
+	};
+
+	// Encoded frames land in the slot for their index, so the output thread only ever has to
+	// look at the one it wants next.
+	struct OutputSlot
+	{
+		std::atomic<bool> ready { false };
+		// The frame we were given, and what it encoded to, which has no memory if it was dropped.
+		void *input;
+		BufferPool::Buffer buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
-		uint64_t index;
+		Clock::time_point queued;
+		Clock::duration encode_time;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
+
+	// These threads do the actual encoding.
+	void encodeThread(int num);
+
+	// Handle the output buffers in another thread so as not to block the encoders. The
+	// application can take its time, after which we return this buffer to the encoder for
+	// re-use.
+	void outputThread();
+
+	// Log p50/p99 of the encode and end-to-end (EncodeBuffer to output) times, and start again.
+	void reportLatency();
+
+	// Drop the oldest frame that nobody has started encoding, if there is one.
+	bool dropOldest();
+	bool hasRoom() const;
+
+	std::atomic<bool> abortEncode_;
+	std::atomic<bool> abortOutput_;
+	uint64_t index_;
+
+	// Frames the application is waiting to get back, so queued, being encoded or waiting to be output.
+	std::atomic<unsigned int> in_flight_;
+	unsigned int max_in_flight_;
+	DropPolicy drop_policy_;
+	std::atomic<uint64_t> dropped_;
+	uint64_t dropped_reported_;
+
+	EncodeRing encode_ring_;
+	Doorbell encode_bell_;
+	std::vector<std::thread> encode_threads_;
+	void encodeJPEG(EncodeItem &item, BufferPool::Buffer &buffer, size_t &buffer_len);
+	BufferPool buffer_pool_;
+
+	std::array<OutputSlot, RING_SIZE> output_ring_;
+	Doorbell output_bell_;
+	// Index of the next frame to be output, EncodeBuffer waits on this for room.
+	std::atomic<uint64_t> output_index_;
+	Doorbell room_bell_;
 	std::thread output_thread_;
+
+	// Only touched by the output thread.
+	std::vector<uint32_t> encode_us_;
+	std::vector<uint32_t> latency_us_;
 };
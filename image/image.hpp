@@ -25,6 +25,24 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
 			   StillOptions const *options, unsigned int, unsigned int);
+
+// Encode a YUV420 image as horizontal bands of MCU rows, as many at once as there are cores, and
+// join them with restart markers into one JPEG. 0 bands means one per core. jpeg_buffer is from
+// malloc and is only reallocated (updating buffer_size) if it's too small. Returns the JPEG size.
+size_t YUV420_to_JPEG_bands(const uint8_t *input, StreamInfo const &info, int quality, unsigned int bands,
+							uint8_t *&jpeg_buffer, size_t &buffer_size);
+
+// Encode a YUV420 image with libjpeg, using a compressor kept for the calling thread whose tables
+// are only set up again when the quality changes. Buffer handling is as for YUV420_to_JPEG_bands.
+size_t YUV420_to_JPEG_libjpeg(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+							  uint8_t *&jpeg_buffer, size_t &buffer_size);
+
+#if TURBOJPEG_PRESENT
+// Encode a YUV420 image straight from its planes with libjpeg-turbo's TurboJPEG API, using a
+// compressor kept for the calling thread. Buffer handling is as for YUV420_to_JPEG_bands.
+size_t YUV420_to_JPEG_turbo(const uint8_t *input, StreamInfo const &info, int quality, uint8_t *&jpeg_buffer,
+							size_t &buffer_size);
+#endif
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options);
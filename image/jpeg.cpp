@@ -9,20 +9,31 @@
 #include <cstring>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
 #include <libexif/exif-data.h>
+#if TURBOJPEG_PRESENT
+#include <turbojpeg.h>
+#endif
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image/image.hpp"
+
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
 #endif
@@ -253,27 +264,206 @@ void exif_read_tag(ExifData *exif, char const *str)
 	}
 }
 
+namespace
+{
+
+// Like jpeg_mem_dest, but writing into a buffer from malloc that is only grown (by realloc) if the
+// image doesn't fit, so the same one can be used frame after frame.
+struct MallocDestination
+{
+	MallocDestination(uint8_t *&buffer, size_t &size) : buffer(buffer), size(size)
+	{
+		pub.init_destination = &MallocDestination::init;
+		pub.empty_output_buffer = &MallocDestination::empty;
+		pub.term_destination = &MallocDestination::term;
+	}
+
+	static void init(j_compress_ptr cinfo)
+	{
+		MallocDestination *dest = reinterpret_cast<MallocDestination *>(cinfo->dest);
+		if (dest->size < 65536)
+			dest->grow(cinfo, 65536);
+		dest->pub.next_output_byte = dest->buffer;
+		dest->pub.free_in_buffer = dest->size;
+	}
+
+	static boolean empty(j_compress_ptr cinfo)
+	{
+		MallocDestination *dest = reinterpret_cast<MallocDestination *>(cinfo->dest);
+		size_t old_size = dest->size;
+		dest->grow(cinfo, old_size * 2);
+		dest->pub.next_output_byte = dest->buffer + old_size;
+		dest->pub.free_in_buffer = dest->size - old_size;
+		return TRUE;
+	}
+
+	static void term(j_compress_ptr cinfo) {}
+
+	void grow(j_compress_ptr cinfo, size_t new_size)
+	{
+		uint8_t *mem = (uint8_t *)realloc(buffer, new_size);
+		if (!mem)
+			ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+		buffer = mem;
+		size = new_size;
+	}
+
+	size_t Length() const { return size - pub.free_in_buffer; }
+
+	// Must come first, libjpeg only knows about this part.
+	struct jpeg_destination_mgr pub;
+	uint8_t *&buffer;
+	size_t &size;
+};
+
+// Creating a compressor and setting up its tables for every image adds up at video rates, so each
+// thread keeps one and only sets the tables up again when the quality changes.
+class Compressor
+{
+public:
+	static Compressor &Get()
+	{
+		thread_local Compressor compressor;
+		return compressor;
+	}
+
+	// Set up for a YCbCr image of this size, given as raw (planar 4:2:0) data or whole scanlines.
+	// The caller points it at a destination, and must clear that again once finished.
+	struct jpeg_compress_struct &Start(unsigned int width, unsigned int height, int quality, unsigned int restart,
+									   bool raw)
+	{
+		cinfo_.image_width = width;
+		cinfo_.image_height = height;
+		if (quality != quality_)
+		{
+			jpeg_set_defaults(&cinfo_);
+			jpeg_set_quality(&cinfo_, quality, TRUE);
+			quality_ = quality;
+		}
+		cinfo_.raw_data_in = raw;
+		cinfo_.restart_interval = restart;
+		return cinfo_;
+	}
+
+private:
+	Compressor()
+	{
+		cinfo_.err = jpeg_std_error(&jerr_);
+		jpeg_create_compress(&cinfo_);
+		cinfo_.input_components = 3;
+		cinfo_.in_color_space = JCS_YCbCr;
+	}
+	~Compressor() { jpeg_destroy_compress(&cinfo_); }
+
+	struct jpeg_compress_struct cinfo_;
+	struct jpeg_error_mgr jerr_;
+	int quality_ = -1;
+};
+
+#if TURBOJPEG_PRESENT
+// The same goes for TurboJPEG's compressors, which can't be shared either.
+struct TurboCompressor
+{
+	TurboCompressor() : handle(tjInitCompress())
+	{
+		if (!handle)
+			throw std::runtime_error("failed to create TurboJPEG compressor");
+	}
+	~TurboCompressor() { tjDestroy(handle); }
+
+	tjhandle handle;
+};
+#endif
+
+} // namespace
+
+#if TURBOJPEG_PRESENT
+static size_t YUV420_planes_to_JPEG_turbo(const unsigned char *planes[3], const int strides[3], unsigned int width,
+										  unsigned int height, int quality, uint8_t *&jpeg_buffer, size_t &buffer_size)
+{
+	thread_local TurboCompressor compressor;
+
+	unsigned char *buffer = jpeg_buffer;
+	unsigned long len = buffer_size;
+	if (tjCompressFromYUVPlanes(compressor.handle, planes, width, strides, height, TJSAMP_420, &buffer, &len, quality,
+								0))
+		throw std::runtime_error(std::string("TurboJPEG encode failed: ") + tjGetErrorStr2(compressor.handle));
+
+	// A frame that doesn't fit goes into a new buffer from malloc, and the old one is left to us.
+	if (buffer != jpeg_buffer)
+	{
+		free(jpeg_buffer);
+		jpeg_buffer = buffer;
+		buffer_size = len;
+	}
+	return len;
+}
+
+size_t YUV420_to_JPEG_turbo(const uint8_t *input, StreamInfo const &info, int quality, uint8_t *&jpeg_buffer,
+							size_t &buffer_size)
+{
+	int stride2 = info.stride / 2;
+	const unsigned char *planes[3];
+	planes[0] = input;
+	planes[1] = planes[0] + info.stride * info.height;
+	planes[2] = planes[1] + stride2 * (info.height / 2);
+	int strides[3] = { (int)info.stride, stride2, stride2 };
+	return YUV420_planes_to_JPEG_turbo(planes, strides, info.width, info.height, quality, jpeg_buffer, buffer_size);
+}
+
+// TurboJPEG takes no packed YUV, so split it into 4:2:0 planes first, averaging the chroma of each
+// pair of rows as libjpeg would when downsampling.
+static size_t YUYV_to_JPEG_turbo(const uint8_t *input, StreamInfo const &info, int quality, uint8_t *&jpeg_buffer,
+								 size_t &buffer_size)
+{
+	unsigned int width2 = info.width / 2, height2 = (info.height + 1) / 2;
+	thread_local std::vector<uint8_t> planar;
+	planar.resize(info.width * info.height + 2 * width2 * height2);
+	uint8_t *Y = planar.data();
+	uint8_t *U = Y + info.width * info.height;
+	uint8_t *V = U + width2 * height2;
+
+	for (unsigned int y = 0; y < info.height; y += 2)
+	{
+		const uint8_t *row0 = input + y * info.stride;
+		const uint8_t *row1 = y + 1 < info.height ? row0 + info.stride : row0;
+		uint8_t *Y0 = Y + y * info.width, *Y1 = y + 1 < info.height ? Y0 + info.width : Y0;
+		uint8_t *U_row = U + (y / 2) * width2, *V_row = V + (y / 2) * width2;
+		for (unsigned int x = 0; x < width2; x++)
+		{
+			Y0[2 * x] = row0[4 * x];
+			Y0[2 * x + 1] = row0[4 * x + 2];
+			Y1[2 * x] = row1[4 * x];
+			Y1[2 * x + 1] = row1[4 * x + 2];
+			U_row[x] = (row0[4 * x + 1] + row1[4 * x + 1] + 1) / 2;
+			V_row[x] = (row0[4 * x + 3] + row1[4 * x + 3] + 1) / 2;
+		}
+	}
+
+	const unsigned char *planes[3] = { Y, U, V };
+	int strides[3] = { (int)info.width, (int)width2, (int)width2 };
+	return YUV420_planes_to_JPEG_turbo(planes, strides, info.width, info.height, quality, jpeg_buffer, buffer_size);
+}
+#endif
+
 static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						 const unsigned int output_width, const unsigned int output_height,
 						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
+	jpeg_buffer = nullptr;
+	size_t buffer_size = 0;
+#if TURBOJPEG_PRESENT
+	// TurboJPEG can't scale or set a restart interval.
+	if (output_width == info.width && output_height == info.height && !restart)
+	{
+		jpeg_len = YUYV_to_JPEG_turbo(input, info, quality, jpeg_buffer, buffer_size);
+		return;
+	}
+#endif
 
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	struct jpeg_compress_struct &cinfo = Compressor::Get().Start(output_width, output_height, quality, restart, false);
+	MallocDestination dest(jpeg_buffer, buffer_size);
+	cinfo.dest = &dest.pub;
 	jpeg_start_compress(&cinfo, TRUE);
 
 	const unsigned int output_width3 = 3 * output_width;
@@ -304,33 +494,15 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	}
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	jpeg_len = dest.Length();
+	cinfo.dest = nullptr;
 }
 
-static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
-								const int quality, const unsigned int restart,
-								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+// Feed libjpeg's raw data interface the rows of a YUV420 image from y0 on, repeating the last row
+// as it pads out the final MCU row.
+static void YUV420_write_rows(struct jpeg_compress_struct &cinfo, const uint8_t *input, StreamInfo const &info,
+							  unsigned int y0)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
 	int stride2 = info.stride / 2;
 	uint8_t *Y = (uint8_t *)input;
 	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
@@ -343,7 +515,8 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
+	for (uint8_t *Y_row = Y + y0 * info.stride, *U_row = U + (y0 / 2) * stride2, *V_row = V + (y0 / 2) * stride2;
+		 cinfo.next_scanline < cinfo.image_height;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -353,39 +526,296 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
 		jpeg_write_raw_data(&cinfo, rows, 16);
 	}
+}
+
+size_t YUV420_to_JPEG_libjpeg(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+							  uint8_t *&jpeg_buffer, size_t &buffer_size)
+{
+	struct jpeg_compress_struct &cinfo = Compressor::Get().Start(info.width, info.height, quality, restart, true);
+	MallocDestination dest(jpeg_buffer, buffer_size);
+	cinfo.dest = &dest.pub;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	YUV420_write_rows(cinfo, input, info, 0);
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	cinfo.dest = nullptr;
+	return dest.Length();
+}
+
+namespace
+{
+
+// Threads to encode the bands of a JPEG, shared by everything encoding them. The thread asking
+// for the bands works through them too, so there's one fewer of these than there are cores.
+class BandWorkers
+{
+public:
+	typedef std::function<void(unsigned int)> Job;
+
+	static BandWorkers &Get()
+	{
+		static BandWorkers workers;
+		return workers;
+	}
+
+	// Call job(0) .. job(n - 1), spread over the threads, returning once they've all finished.
+	void Run(unsigned int n, Job const &job)
+	{
+		Batch batch = { &job, n };
+		std::unique_lock<std::mutex> lock(mutex_);
+		batches_.push_back(&batch);
+		cond_var_.notify_all();
+		work(lock, batch);
+		done_cond_var_.wait(lock, [&batch]() { return batch.done == batch.n && batch.users == 0; });
+	}
+
+private:
+	struct Batch
+	{
+		Job const *job;
+		unsigned int n;
+		unsigned int next = 0;
+		unsigned int done = 0;
+		unsigned int users = 0;
+	};
+
+	BandWorkers()
+	{
+		unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int i = 1; i < cores; i++)
+			threads_.emplace_back(&BandWorkers::thread, this);
+	}
+
+	~BandWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			cond_var_.notify_all();
+		}
+		for (auto &thread : threads_)
+			thread.join();
+	}
+
+	// Called with the lock held. Do jobs from the batch until there are none left to start; the
+	// batch must not be touched after users goes back to zero, the caller may have returned.
+	void work(std::unique_lock<std::mutex> &lock, Batch &batch)
+	{
+		batch.users++;
+		while (batch.next < batch.n)
+		{
+			unsigned int i = batch.next++;
+			if (batch.next == batch.n)
+				batches_.erase(std::find(batches_.begin(), batches_.end(), &batch));
+			lock.unlock();
+			(*batch.job)(i);
+			lock.lock();
+			batch.done++;
+		}
+		if (--batch.users == 0 && batch.done == batch.n)
+			done_cond_var_.notify_all();
+	}
+
+	void thread()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			cond_var_.wait(lock, [this]() { return abort_ || !batches_.empty(); });
+			if (abort_)
+				return;
+			work(lock, *batches_.front());
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::condition_variable done_cond_var_;
+	std::deque<Batch *> batches_;
+	std::vector<std::thread> threads_;
+	bool abort_ = false;
+};
+
+// Like jpeg_mem_dest, but into a vector that's only ever grown, so it can be used frame after frame.
+struct VectorDestination
+{
+	VectorDestination(std::vector<uint8_t> &vec) : vec(vec)
+	{
+		pub.init_destination = &VectorDestination::init;
+		pub.empty_output_buffer = &VectorDestination::empty;
+		pub.term_destination = &VectorDestination::term;
+	}
+
+	static void init(j_compress_ptr cinfo)
+	{
+		VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+		if (dest->vec.size() < 65536)
+			dest->vec.resize(65536);
+		dest->pub.next_output_byte = dest->vec.data();
+		dest->pub.free_in_buffer = dest->vec.size();
+	}
+
+	static boolean empty(j_compress_ptr cinfo)
+	{
+		VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+		size_t old_size = dest->vec.size();
+		dest->vec.resize(old_size * 2);
+		dest->pub.next_output_byte = dest->vec.data() + old_size;
+		dest->pub.free_in_buffer = old_size;
+		return TRUE;
+	}
+
+	static void term(j_compress_ptr cinfo) {}
+
+	size_t Length() const { return vec.size() - pub.free_in_buffer; }
+
+	// Must come first, libjpeg only knows about this part.
+	struct jpeg_destination_mgr pub;
+	std::vector<uint8_t> &vec;
+};
+
+} // namespace
+
+// Encode the rows y0 to y0 + height as if they were a whole image. Restart intervals are set to
+// cover the band, so there are no markers inside it and the DC prediction starts afresh.
+static size_t YUV420_to_JPEG_band(const uint8_t *input, StreamInfo const &info, const int quality,
+								  const unsigned int restart, unsigned int y0, unsigned int height,
+								  std::vector<uint8_t> &output)
+{
+	struct jpeg_compress_struct &cinfo = Compressor::Get().Start(info.width, height, quality, restart, true);
+	VectorDestination dest(output);
+	cinfo.dest = &dest.pub;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	YUV420_write_rows(cinfo, input, info, y0);
+
+	jpeg_finish_compress(&cinfo);
+	cinfo.dest = nullptr;
+	return dest.Length();
+}
+
+// Walk the markers of a JPEG to the start of the entropy coded data, noting where the frame
+// header is on the way.
+static size_t find_scan_data(std::vector<uint8_t> const &jpeg, size_t len, size_t *sof)
+{
+	size_t pos = 2;
+	while (pos + 4 <= len && jpeg[pos] == 0xff)
+	{
+		uint8_t marker = jpeg[pos + 1];
+		size_t segment_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		if (marker == 0xc0 && sof)
+			*sof = pos;
+		pos += 2 + segment_len;
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("malformed JPEG band");
+}
+
+size_t YUV420_to_JPEG_bands(const uint8_t *input, StreamInfo const &info, int quality, unsigned int bands,
+							uint8_t *&jpeg_buffer, size_t &buffer_size)
+{
+	if (!bands)
+		bands = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// Bands are whole rows of 16x16 MCUs, and a restart interval can be no more than 65535 MCUs.
+	unsigned int mcus_per_row = (info.width + 15) / 16;
+	unsigned int mcu_rows = (info.height + 15) / 16;
+	unsigned int rows_per_band = std::clamp((mcu_rows + bands - 1) / bands, 1u, std::max(65535 / mcus_per_row, 1u));
+	bands = (mcu_rows + rows_per_band - 1) / rows_per_band;
+	unsigned int restart = bands > 1 ? rows_per_band * mcus_per_row : 0;
+
+	// Kept from one frame to the next so that they settle at the right size. The lambda must see
+	// this thread's ones, not those of whichever thread runs it.
+	thread_local std::vector<std::vector<uint8_t>> thread_band_buffers;
+	thread_local std::vector<size_t> thread_band_lens;
+	std::vector<std::vector<uint8_t>> &band_buffers = thread_band_buffers;
+	std::vector<size_t> &band_lens = thread_band_lens;
+	if (band_buffers.size() < bands)
+		band_buffers.resize(bands);
+	band_lens.resize(bands);
+
+	BandWorkers::Get().Run(bands, [&](unsigned int i) {
+		unsigned int y0 = i * rows_per_band * 16;
+		unsigned int height = std::min(rows_per_band * 16, info.height - y0);
+		band_lens[i] = YUV420_to_JPEG_band(input, info, quality, restart, y0, height, band_buffers[i]);
+	});
+
+	// The first band keeps its headers, the rest are just their entropy coded data. Each ends with
+	// an EOI marker, which becomes the restart marker before the next band.
+	size_t sof = 0;
+	std::vector<size_t> starts(bands);
+	starts[0] = 0;
+	find_scan_data(band_buffers[0], band_lens[0], &sof);
+	if (!sof)
+		throw std::runtime_error("no baseline frame header in JPEG band");
+	size_t total = band_lens[0];
+	for (unsigned int i = 1; i < bands; i++)
+	{
+		starts[i] = find_scan_data(band_buffers[i], band_lens[i], nullptr);
+		total += band_lens[i] - starts[i];
+	}
+
+	if (buffer_size < total)
+	{
+		uint8_t *mem = (uint8_t *)realloc(jpeg_buffer, total);
+		if (!mem)
+			throw std::runtime_error("failed to allocate JPEG buffer");
+		jpeg_buffer = mem;
+		buffer_size = total;
+	}
+
+	size_t pos = 0;
+	for (unsigned int i = 0; i < bands; i++)
+	{
+		size_t len = band_lens[i] - starts[i];
+		memcpy(jpeg_buffer + pos, band_buffers[i].data() + starts[i], len);
+		pos += len;
+		if (i + 1 < bands)
+			jpeg_buffer[pos - 1] = 0xd0 + (i & 7); // RSTn in place of the EOI
+	}
+
+	// The frame header still has the height of the first band.
+	jpeg_buffer[sof + 5] = info.height >> 8;
+	jpeg_buffer[sof + 6] = info.height & 0xff;
+
+	return pos;
+}
+
+static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
+								const int quality, const unsigned int restart, const unsigned int bands,
+								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	size_t buffer_size = 0;
+	jpeg_buffer = nullptr;
+	if (bands != 1)
+		jpeg_len = YUV420_to_JPEG_bands(input, info, quality, bands, jpeg_buffer, buffer_size);
+#if TURBOJPEG_PRESENT
+	// TurboJPEG can't set a restart interval.
+	else if (!restart)
+		jpeg_len = YUV420_to_JPEG_turbo(input, info, quality, jpeg_buffer, buffer_size);
+#endif
+	else
+		jpeg_len = YUV420_to_JPEG_libjpeg(input, info, quality, restart, jpeg_buffer, buffer_size);
 }
 
 static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						   const unsigned int output_width, const unsigned int output_height,
-						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
-						   jpeg_mem_len_t &jpeg_len)
+						   const int quality, const unsigned int restart, const unsigned int bands,
+						   uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
 	if (info.width == output_width && info.height == output_height)
 	{
-		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
+		YUV420_to_JPEG_fast(input, info, quality, restart, bands, jpeg_buffer, jpeg_len);
 		return;
 	}
 
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	jpeg_buffer = nullptr;
+	size_t buffer_size = 0;
+	struct jpeg_compress_struct &cinfo = Compressor::Get().Start(output_width, output_height, quality, restart, false);
+	MallocDestination dest(jpeg_buffer, buffer_size);
+	cinfo.dest = &dest.pub;
 	jpeg_start_compress(&cinfo, TRUE);
 
 	const unsigned int output_width3 = 3 * output_width;
@@ -420,16 +850,18 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	}
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	jpeg_len = dest.Length();
+	cinfo.dest = nullptr;
 }
 
 static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int output_width, const int output_height,
-						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+						const int quality, const unsigned int restart, const unsigned int bands, uint8_t *&jpeg_buffer,
+						jpeg_mem_len_t &jpeg_len)
 {
 	if (info.pixel_format == libcamera::formats::YUYV)
 		YUYV_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
 	else if (info.pixel_format == libcamera::formats::YUV420)
-		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
+		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart, bands, jpeg_buffer, jpeg_len);
 	else
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
 }
@@ -535,7 +967,7 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			for (; q > 0; q -= 5)
 			{
 				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->thumb_width,
-							options->thumb_height, q, 0, thumb_buffer, thumb_len);
+							options->thumb_height, q, 0, 1, thumb_buffer, thumb_len);
 				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
 					break;
 				free(thumb_buffer);
@@ -598,7 +1030,7 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		jpeg_mem_len_t jpeg_len;
 
 		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, output_width, output_height, options->quality, options->restart,
-					jpeg_buffer, jpeg_len);
+					options->jpeg_bands, jpeg_buffer, jpeg_len);
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -31,7 +31,7 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 		openFile(timestamp_us);
 	}
 
-	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
+	LOG_RATE_LIMITED(2, 1000, "FileOutput: output buffer " << mem << " size " << size);
 	if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
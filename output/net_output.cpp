@@ -100,7 +100,7 @@ constexpr size_t MAX_UDP_SIZE = 65507;
 
 void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
 {
-	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
+	LOG_RATE_LIMITED(2, 1000, "NetOutput: output buffer " << mem << " size " << size);
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
 	for (uint8_t *ptr = (uint8_t *)mem; size;)
 	{
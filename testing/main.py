@@ -9,6 +9,9 @@ PROGRAM_PATH = "./build/apps/rpicam-mjpeg"
 VIDEO_OUTPUT = "/tmp/cam.mp4"
 STILL_OUTPUT = "/tmp/cam.jpg"
 PREVIEW_OUTPUT = "/dev/shm/mjpeg/cam.jpg"
+LAPSE_OUTPUT = "/tmp/tl_%t.jpg"
+MACROS_PATH = "/tmp/macros"
+CONTROL_SOCKET = "/tmp/mjpeg_control.sock"
 
 class TestResult:
     def __init__(self, name):
@@ -27,7 +30,10 @@ def run_program():
         "--video_path", VIDEO_OUTPUT,
         "--image_path", STILL_OUTPUT,
         "--preview_path", PREVIEW_OUTPUT,
-        "--control_file", FIFO_PATH
+        "--lapse_path", LAPSE_OUTPUT,
+        "--macros_path", MACROS_PATH,
+        "--control_file", FIFO_PATH,
+        "--control_socket", CONTROL_SOCKET
     ]
 
     # Start the rpicam_mjpeg program
@@ -68,6 +74,10 @@ def main():
         import test_qu
         import test_bi
         import test_sh
+        import test_tl
+        import test_sy
+        import test_ri
+        import test_socket
 
         # Run tests
         test_modules = [
@@ -89,7 +99,11 @@ def main():
             test_sa,
             test_qu,
             test_bi,
-            test_sh
+            test_sh,
+            test_tl,
+            test_sy,
+            test_ri,
+            test_socket
         ]
 
         for test_module in test_modules:
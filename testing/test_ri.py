@@ -0,0 +1,19 @@
+import time
+
+def run_test(send_command):
+    print("Testing 'ri' command (set sensor region)...")
+    # Zoom in on the middle of the sensor
+    send_command("ri 16384 16384 32768 32768")
+    print("Zoomed in on the middle quarter")
+    time.sleep(2)
+    # Capture an image to verify the zoom
+    send_command("im")
+    time.sleep(2)
+    # You may manually check the image to verify the zoom
+    print("Captured image for zoom verification.")
+
+    # Pan back out to the whole sensor over 30 frames
+    send_command("ri 0 0 65536 65536 30")
+    print("Zooming back out over 30 frames")
+    time.sleep(3)
+    print("'ri' command test completed.\n")
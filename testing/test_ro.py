@@ -12,6 +12,14 @@ def run_test(send_command):
     # You may manually check the image to verify rotation
     print("Captured image for rotation verification.")
 
+    # 90 degrees is done in software, the image should come out portrait
+    send_command("ro 90")
+    print("Set rotation to 90 degrees")
+    time.sleep(2)
+    send_command("im")
+    time.sleep(2)
+    print("Captured image for 90 degree rotation verification.")
+
     # Reset rotation to 0 degrees
     send_command("ro 0")
     print("Reset rotation to 0 degrees")
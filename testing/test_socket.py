@@ -0,0 +1,32 @@
+import socket
+
+CONTROL_SOCKET = "/tmp/mjpeg_control.sock"
+
+def run_test(send_command):
+    print("Testing the control socket...")
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as sock:
+            sock.settimeout(5)
+            sock.connect(CONTROL_SOCKET)
+
+            # A batch of commands gets one acknowledgement with the frame they reached
+            sock.send(b"br 60\nco 10\n")
+            reply = sock.recv(4096).decode().split()
+            if reply[0] != "OK" or not reply[1].isdigit():
+                raise Exception(f"Unexpected reply to batch: {reply}")
+            print(f"Batch applied at frame {reply[1]}.")
+
+            # A bad command fails its batch
+            sock.send(b"br 50\nxx 1\n")
+            reply = sock.recv(4096).decode()
+            if not reply.startswith("ERR xx 1"):
+                raise Exception(f"Unexpected reply to bad batch: {reply}")
+            print("Bad batch rejected.")
+
+            # Put things back
+            sock.send(b"br 50\nco 0\n")
+            sock.recv(4096)
+        print("Control socket test completed.\n")
+    except Exception as e:
+        print(f"Control socket test failed: {e}")
+        raise
@@ -0,0 +1,29 @@
+import time
+import os
+
+def run_test(send_command):
+    print("Testing 'sy' command (run macro)...")
+    macros_path = "/tmp/macros"
+    macro_output = "/tmp/sy_test.txt"
+    try:
+        # A macro that writes its arguments to a file
+        os.makedirs(macros_path, exist_ok=True)
+        macro = os.path.join(macros_path, "sy_test.sh")
+        with open(macro, "w") as f:
+            f.write(f"#!/bin/sh\necho \"$@\" > {macro_output}\n")
+        os.chmod(macro, 0o755)
+        if os.path.exists(macro_output):
+            os.remove(macro_output)
+
+        send_command("sy sy_test.sh hello world")
+        time.sleep(1)
+
+        # Verify that the macro ran with the arguments
+        with open(macro_output) as f:
+            if f.read().strip() != "hello world":
+                raise Exception("Macro ran with the wrong arguments.")
+        print("Macro ran successfully.")
+        print("'sy' command test completed.\n")
+    except Exception as e:
+        print(f"'sy' command test failed: {e}")
+        raise
@@ -0,0 +1,32 @@
+import time
+import os
+import glob
+from PIL import Image
+
+def run_test(send_command):
+    print("Testing 'tl' command (timelapse)...")
+    lapse_output = "/tmp/tl_*.jpg"
+    try:
+        # Remove existing timelapse frames if they exist
+        for frame in glob.glob(lapse_output):
+            os.remove(frame)
+
+        # A frame every half second, for three seconds
+        send_command("tv 5")
+        send_command("tl 1")
+        time.sleep(3)
+        send_command("tl 0")
+        time.sleep(2)
+
+        # Verify that the frames exist and are valid
+        frames = glob.glob(lapse_output)
+        if len(frames) < 4:
+            raise Exception(f"Expected at least 4 timelapse frames, got {len(frames)}.")
+        for frame in frames:
+            with Image.open(frame) as img:
+                img.verify()  # Verify that it's a valid image
+        print(f"Timelapse captured {len(frames)} frames successfully.")
+        print("'tl' command test completed.\n")
+    except Exception as e:
+        print(f"'tl' command test failed: {e}")
+        raise